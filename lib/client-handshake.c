@@ -90,20 +90,16 @@ struct libwebsocket *__libwebsocket_client_connect_2(
 
 	debug("connected\n");
 
-	/* into fd -> wsi hashtable */
+	/* into fd -> wsi hashtable and internal poll list */
 
-	insert_wsi(context, wsi);
-
-	/* into internal poll list */
-
-	context->fds[context->fds_count].fd = wsi->sock;
-	context->fds[context->fds_count].revents = 0;
-	context->fds[context->fds_count++].events = POLLIN;
-
-	/* external POLL support via protocol 0 */
-	context->protocols[0].callback(context, wsi,
-		LWS_CALLBACK_ADD_POLL_FD,
-		(void *)(long)wsi->sock, NULL, POLLIN);
+	if (insert_wsi_socket_into_fds(context, wsi)) {
+#ifdef WIN32
+		closesocket(wsi->sock);
+#else
+		close(wsi->sock);
+#endif
+		goto oom4;
+	}
 
 	/* we are connected to server, or proxy */
 
@@ -120,7 +116,7 @@ struct libwebsocket *__libwebsocket_client_connect_2(
 			goto bail1;
 		}
 
-		libwebsocket_set_timeout(wsi,
+		libwebsocket_set_timeout(context, wsi,
 			PENDING_TIMEOUT_AWAITING_PROXY_RESPONSE, 5);
 
 		wsi->mode = LWS_CONNMODE_WS_CLIENT_WAITING_PROXY_REPLY;
@@ -206,6 +202,7 @@ libwebsocket_client_connect(struct libwebsocket_context *context,
 		goto bail1;
 
 	memset(wsi, 0, sizeof *wsi);
+	wsi->position_in_fds_table = -1;
 
 	/* -1 means just use latest supported */
 
@@ -333,7 +330,7 @@ libwebsocket_client_connect(struct libwebsocket_context *context,
 	if (handled) {
 		debug("libwebsocket_client_connect: ext handling conn\n");
 
-		libwebsocket_set_timeout(wsi,
+		libwebsocket_set_timeout(context, wsi,
 			PENDING_TIMEOUT_AWAITING_EXTENSION_CONNECT_RESPONSE, 5);
 
 		wsi->mode = LWS_CONNMODE_WS_CLIENT_WAITING_EXTENSION_CONNECT;
@@ -323,7 +323,7 @@ interpret:
 				            conn->block_subchannel -
 			  	  	  	   MUX_REAL_CHILD_INDEX_OFFSET];
 
-			libwebsocket_parse(wsi_child, c);
+			libwebsocket_parse(context, wsi_child, c);
 
 			if (--conn->length)
 				return 0;
@@ -371,7 +371,8 @@ interpret:
 
 			/* clear his proxy connection timeout */
 
-			libwebsocket_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
+			libwebsocket_set_timeout(context, wsi,
+							NO_PENDING_TIMEOUT, 0);
 
 			/* mark him as being alive */
 
@@ -563,10 +564,13 @@ bail2:
 		case LWS_CONNMODE_WS_CLIENT:
 //			fprintf(stderr, "  client\n");
 			if (libwebsocket_client_rx_sm(wsi_child, c) < 0) {
+				if (!wsi_child->close_reason)
+					wsi_child->close_reason =
+						     LWS_CLOSE_STATUS_GOINGAWAY;
 				libwebsocket_close_and_free_session(
 					context,
 					wsi_child,
-					LWS_CLOSE_STATUS_GOINGAWAY);
+					wsi_child->close_reason);
 			}
 
 			return 0;
@@ -577,10 +581,13 @@ bail2:
 //			fprintf(stderr, "  server\n");
 			if (libwebsocket_rx_sm(wsi_child, c) < 0) {
 				muxdebug("probs\n");
+				if (!wsi_child->close_reason)
+					wsi_child->close_reason =
+						     LWS_CLOSE_STATUS_GOINGAWAY;
 				libwebsocket_close_and_free_session(
 					context,
 					wsi_child,
-					LWS_CLOSE_STATUS_GOINGAWAY);
+					wsi_child->close_reason);
 			}
 			break;
 		}
@@ -753,7 +760,8 @@ int lws_extension_callback_x_google_mux(
 		 * he will become a possible mux parent later
 		 */
 
-		mux_ctx->wsi_muxconns[mux_ctx->active_conns++] = wsi;
+		if (mux_ctx->active_conns < MAX_XGM_MUXCONNS)
+			mux_ctx->wsi_muxconns[mux_ctx->active_conns++] = wsi;
 		if (done)
 			return 1;
 
@@ -1094,17 +1102,6 @@ handle_additions:
 
 		return 1; /* handled */
 
-	case LWS_EXT_CALLBACK_1HZ:
-		/*
-		 * if we have children, service their timeouts using the same
-		 * handler as toplevel guys to allow recursion
-		 */
-		for (n = 0; n < conn->highest_child_subchannel; n++)
-			if (conn->wsi_children[n])
-				libwebsocket_service_timeout_check(context,
-						    conn->wsi_children[n], len);
-		break;
-
 	case LWS_EXT_CALLBACK_REQUEST_ON_WRITEABLE:
 		/*
 		 * if a mux child is asking for callback on writable, we have
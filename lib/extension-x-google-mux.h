@@ -22,6 +22,8 @@ void muxdebug(const char *format, ...)
 #endif
 
 #define MAX_XGM_SUBCHANNELS 8192
+#define MAX_XGM_MUXCONNS 100
+#define MAX_XGM_CHILDREN 100
 
 enum lws_ext_x_google_mux__parser_states {
 	LWS_EXT_XGM_STATE__MUX_BLOCK_1,
@@ -60,7 +62,7 @@ struct lws_ext_x_google_mux_context {
 	 * these are listing physical connections, not children sharing a
 	 * parent mux physical connection
 	 */
-	struct libwebsocket *wsi_muxconns[MAX_CLIENTS];
+	struct libwebsocket *wsi_muxconns[MAX_XGM_MUXCONNS];
 	/*
 	 * when this is < 2, we do not do any mux blocks
 	 * just pure websockets
@@ -78,7 +80,7 @@ struct lws_ext_x_google_mux_conn {
 	/* child points to the mux wsi using this */
 	struct libwebsocket *wsi_parent;
 	int subchannel;
-	struct libwebsocket *wsi_children[MAX_CLIENTS];
+	struct libwebsocket *wsi_children[MAX_XGM_CHILDREN];
 	int highest_child_subchannel;
 	char awaiting_POLLOUT;
 	int count_children_needing_POLLOUT;
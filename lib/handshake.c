@@ -190,6 +190,7 @@ handshake_00(struct libwebsocket_context *context, struct libwebsocket *wsi)
 	free(response);
 	wsi->state = WSI_STATE_ESTABLISHED;
 	wsi->lws_rx_parse_state = LWS_RXPS_NEW;
+	lws_protocol_join(wsi);
 
 	/* notify user code that we're ready to roll */
 
@@ -427,6 +428,7 @@ handshake_0405(struct libwebsocket_context *context, struct libwebsocket *wsi)
 				wsi->count_active_extensions++;
 				debug("wsi->count_active_extensions <- %d",
 						  wsi->count_active_extensions);
+				lws_ext_1hz_add(context, wsi);
 
 				ext++;
 			}
@@ -487,6 +489,7 @@ handshake_0405(struct libwebsocket_context *context, struct libwebsocket *wsi)
 	free(response);
 	wsi->state = WSI_STATE_ESTABLISHED;
 	wsi->lws_rx_parse_state = LWS_RXPS_NEW;
+	lws_protocol_join(wsi);
 	wsi->rx_packet_length = 0;
 
 	/* notify user code that we're ready to roll */
@@ -532,8 +535,8 @@ bail:
 /*
  * We have to take care about parsing because the headers may be split
  * into multiple fragments.  They may contain unknown headers with arbitrary
- * argument lengths.  So, we parse using a single-character at a time state
- * machine that is completely independent of packet size.
+ * argument lengths.  So, the parser keeps its state in the wsi and can stop
+ * and resume at any byte, completely independent of packet size.
  */
 
 int
@@ -570,8 +573,8 @@ libwebsocket_read(struct libwebsocket_context *context,
 
 		/* LWS_CONNMODE_WS_SERVING */
 
-		for (n = 0; n < len; n++)
-			libwebsocket_parse(wsi, *buf++);
+		if (lws_parse_span(context, wsi, buf, len) < 0)
+			goto bail;
 
 		if (wsi->parser_state != WSI_PARSING_COMPLETE)
 			break;
@@ -693,9 +696,9 @@ libwebsocket_read(struct libwebsocket_context *context,
 	case WSI_STATE_ESTABLISHED:
 		switch (wsi->mode) {
 		case LWS_CONNMODE_WS_CLIENT:
-			for (n = 0; n < len; n++)
-				if (libwebsocket_client_rx_sm(wsi, *buf++) < 0)
-					goto bail;
+			if (libwebsocket_client_interpret_incoming_packet(wsi,
+								buf, len) < 0)
+				goto bail;
 
 			return 0;
 		default:
@@ -715,8 +718,8 @@ libwebsocket_read(struct libwebsocket_context *context,
 	return 0;
 
 bail:
-	libwebsocket_close_and_free_session(context, wsi,
-						     LWS_CLOSE_STATUS_NOSTATUS);
+	/* the rx parser may have left a reason for the close frame */
+	libwebsocket_close_and_free_session(context, wsi, wsi->close_reason);
 
 	return -1;
 }
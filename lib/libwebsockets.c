@@ -55,32 +55,54 @@ strtolower(char *s)
 	}
 }
 
-/* file descriptor hash management */
+/*
+ * file descriptor to wsi lookup
+ *
+ * A table indexed directly by the descriptor, grown as higher descriptors
+ * turn up.  Descriptors are allocated lowest-first by the kernel so the
+ * table stays about as big as the number of open connections.
+ */
 
 struct libwebsocket *
 wsi_from_fd(struct libwebsocket_context *context, int fd)
 {
-	int h = LWS_FD_HASH(fd);
-	int n = 0;
-
-	for (n = 0; n < context->fd_hashtable[h].length; n++)
-		if (context->fd_hashtable[h].wsi[n]->sock == fd)
-			return context->fd_hashtable[h].wsi[n];
+	if (fd < 0 || fd >= context->lws_lookup_len)
+		return NULL;
 
-	return NULL;
+	return context->lws_lookup[fd];
 }
 
 int
 insert_wsi(struct libwebsocket_context *context, struct libwebsocket *wsi)
 {
-	int h = LWS_FD_HASH(wsi->sock);
+	struct libwebsocket **grown;
+	int n;
 
-	if (context->fd_hashtable[h].length == MAX_CLIENTS - 1) {
-		fprintf(stderr, "hash table overflow\n");
+	if (wsi->sock < 0)
 		return 1;
+
+	if (wsi->sock >= context->lws_lookup_len) {
+		n = context->lws_lookup_len * 2;
+		if (n < LWS_INITIAL_LOOKUP_ALLOC)
+			n = LWS_INITIAL_LOOKUP_ALLOC;
+		while (n <= wsi->sock)
+			n *= 2;
+		grown = realloc(context->lws_lookup, n * sizeof(*grown));
+		if (grown == NULL) {
+			fprintf(stderr, "Out of memory for fd lookup table\n");
+			return 1;
+		}
+		memset(&grown[context->lws_lookup_len], 0,
+			      (n - context->lws_lookup_len) * sizeof(*grown));
+		context->lws_lookup = grown;
+		context->lws_lookup_len = n;
 	}
 
-	context->fd_hashtable[h].wsi[context->fd_hashtable[h].length++] = wsi;
+	if (context->lws_lookup[wsi->sock])
+		fprintf(stderr, "insert_wsi: fd %d already in use\n",
+								    wsi->sock);
+
+	context->lws_lookup[wsi->sock] = wsi;
 
 	return 0;
 }
@@ -88,24 +110,224 @@ insert_wsi(struct libwebsocket_context *context, struct libwebsocket *wsi)
 int
 delete_from_fd(struct libwebsocket_context *context, int fd)
 {
-	int h = LWS_FD_HASH(fd);
-	int n = 0;
+	if (fd < 0 || fd >= context->lws_lookup_len ||
+						   !context->lws_lookup[fd]) {
+		fprintf(stderr, "Failed to find fd %d requested for "
+						   "delete in lookup table\n", fd);
+		return 1;
+	}
 
-	for (n = 0; n < context->fd_hashtable[h].length; n++)
-		if (context->fd_hashtable[h].wsi[n]->sock == fd) {
-			while (n < context->fd_hashtable[h].length) {
-				context->fd_hashtable[h].wsi[n] =
-					    context->fd_hashtable[h].wsi[n + 1];
-				n++;
-			}
-			context->fd_hashtable[h].length--;
+	context->lws_lookup[fd] = NULL;
 
-			return 0;
+	return 0;
+}
+
+int
+lws_set_nonblocking(int fd, int nonblocking)
+{
+#ifdef WIN32
+	unsigned long optl = !!nonblocking;
+
+	return ioctlsocket(fd, FIONBIO, &optl);
+#else
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags < 0)
+		return -1;
+
+	if (nonblocking)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	return fcntl(fd, F_SETFL, flags);
+#endif
+}
+
+/* poll set management, keeps fds[], epoll and external poll users in step */
+
+#ifdef LWS_HAS_EPOLL
+static int
+lws_epoll_ctl(struct libwebsocket_context *context, int op, int fd, int events)
+{
+	struct epoll_event ev;
+
+	if (context->epoll_fd < 0)
+		return 0;
+
+	memset(&ev, 0, sizeof ev);
+	if (events & POLLIN)
+		ev.events |= EPOLLIN;
+	if (events & POLLOUT)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(context->epoll_fd, op, fd, &ev) < 0) {
+		fprintf(stderr, "epoll_ctl %d on fd %d failed: %s\n",
+						     op, fd, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+#endif
+
+int
+insert_wsi_socket_into_fds(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi)
+{
+	struct pollfd *grown;
+	int n;
+
+	if (context->fds_count == context->fds_alloc) {
+		n = context->fds_alloc * 2;
+		if (!n)
+			n = LWS_INITIAL_FDS_ALLOC;
+		grown = realloc(context->fds, n * sizeof(*grown));
+		if (grown == NULL) {
+			fprintf(stderr, "Out of memory for poll array\n");
+			return 1;
 		}
+		context->fds = grown;
+		context->fds_alloc = n;
+	}
 
-	fprintf(stderr, "Failed to find fd %d requested for "
-						   "delete in hashtable\n", fd);
-	return 1;
+	if (insert_wsi(context, wsi))
+		return 1;
+
+	/*
+	 * make sure NO events are seen yet on this new socket
+	 * (otherwise we inherit old fds[client].revents from
+	 * previous socket there and die mysteriously! )
+	 */
+	wsi->position_in_fds_table = context->fds_count;
+	wsi->connection_id = ((unsigned long long)
+		    ++context->connection_serial << 32) | (unsigned int)wsi->sock;
+	context->fds[context->fds_count].fd = wsi->sock;
+	context->fds[context->fds_count].events = POLLIN;
+	context->fds[context->fds_count++].revents = 0;
+
+#ifdef LWS_HAS_EPOLL
+	lws_epoll_ctl(context, EPOLL_CTL_ADD, wsi->sock, POLLIN);
+#endif
+
+	/* external POLL support via protocol 0 */
+	context->protocols[0].callback(context, wsi,
+		LWS_CALLBACK_ADD_POLL_FD,
+		(void *)(long)wsi->sock, NULL, POLLIN);
+
+	return 0;
+}
+
+/*
+ * Each protocol keeps a list of its established connections, so fanning
+ * out to a protocol only visits its members rather than every connection
+ */
+
+void
+lws_protocol_join(struct libwebsocket *wsi)
+{
+	struct libwebsocket_protocols *protocol =
+				(struct libwebsocket_protocols *)wsi->protocol;
+
+	if (wsi->protocol_prev)
+		return;
+
+	wsi->protocol_next = protocol->established_list;
+	if (wsi->protocol_next)
+		wsi->protocol_next->protocol_prev = &wsi->protocol_next;
+	wsi->protocol_prev = &protocol->established_list;
+	protocol->established_list = wsi;
+}
+
+void
+lws_protocol_leave(struct libwebsocket *wsi)
+{
+	if (!wsi->protocol_prev)
+		return;
+
+	*wsi->protocol_prev = wsi->protocol_next;
+	if (wsi->protocol_next)
+		wsi->protocol_next->protocol_prev = wsi->protocol_prev;
+	wsi->protocol_next = NULL;
+	wsi->protocol_prev = NULL;
+}
+
+void
+remove_wsi_socket_from_fds(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi)
+{
+	struct libwebsocket *end_wsi;
+	int m;
+
+	delete_from_fd(context, wsi->sock);
+
+	/*
+	 * delete it from the internal poll list if still present, by moving
+	 * the last entry into its slot
+	 */
+
+	m = wsi->position_in_fds_table;
+	if (m >= 0 && m < context->fds_count &&
+					   context->fds[m].fd == wsi->sock) {
+		context->fds[m] = context->fds[context->fds_count - 1];
+		context->fds_count--;
+		end_wsi = wsi_from_fd(context, context->fds[m].fd);
+		if (m != context->fds_count && end_wsi)
+			end_wsi->position_in_fds_table = m;
+	}
+	wsi->position_in_fds_table = -1;
+
+#ifdef LWS_HAS_EPOLL
+	/* explicitly, since a forked process may still hold the socket open */
+	lws_epoll_ctl(context, EPOLL_CTL_DEL, wsi->sock, 0);
+#endif
+
+	/* remove also from external POLL support via protocol 0 */
+	context->protocols[0].callback(context, wsi,
+		    LWS_CALLBACK_DEL_POLL_FD, (void *)(long)wsi->sock, NULL, 0);
+}
+
+/*
+ * lws_change_pollfd() - clear and then set event bits we are waiting for
+ *
+ * Both the internal poll array and the epoll set, if any, are updated and
+ * external poll users are told with LWS_CALLBACK_CLEAR_MODE_POLL_FD and
+ * LWS_CALLBACK_SET_MODE_POLL_FD.  Returns nonzero if the socket was not
+ * found in the internal poll array.
+ */
+
+int
+lws_change_pollfd(struct libwebsocket_context *context,
+			      struct libwebsocket *wsi, int clear, int set)
+{
+	struct pollfd *pfd;
+	int n = wsi->position_in_fds_table;
+	int ret = 1;
+
+	if (n >= 0 && n < context->fds_count &&
+					   context->fds[n].fd == wsi->sock) {
+		pfd = &context->fds[n];
+		pfd->events &= ~clear;
+		pfd->events |= set;
+#ifdef LWS_HAS_EPOLL
+		lws_epoll_ctl(context, EPOLL_CTL_MOD, wsi->sock, pfd->events);
+#endif
+		ret = 0;
+	}
+
+	/* external POLL support via protocol 0 */
+
+	if (clear)
+		context->protocols[0].callback(context, wsi,
+			LWS_CALLBACK_CLEAR_MODE_POLL_FD,
+			(void *)(long)wsi->sock, NULL, clear);
+	if (set)
+		context->protocols[0].callback(context, wsi,
+			LWS_CALLBACK_SET_MODE_POLL_FD,
+			(void *)(long)wsi->sock, NULL, set);
+
+	return ret;
 }
 
 #ifdef LWS_OPENSSL_SUPPORT
@@ -276,7 +498,7 @@ libwebsocket_close_and_free_session(struct libwebsocket_context *context,
 
 			/* and we should wait for a reply for a bit */
 
-			libwebsocket_set_timeout(wsi,
+			libwebsocket_set_timeout(context, wsi,
 						  PENDING_TIMEOUT_CLOSE_ACK, 5);
 
 			debug("sent close indication, awaiting ack\n");
@@ -293,32 +515,20 @@ just_kill_connection:
 
 	/*
 	 * we won't be servicing or receiving anything further from this guy
-	 * remove this fd from wsi mapping hashtable
+	 * remove this fd from wsi mapping hashtable and the poll set
 	 */
 
 	if (wsi->sock)
-		delete_from_fd(context, wsi->sock);
+		remove_wsi_socket_from_fds(context, wsi);
 
-	/* delete it from the internal poll list if still present */
-
-	for (n = 0; n < context->fds_count; n++) {
-		if (context->fds[n].fd != wsi->sock)
-			continue;
-		while (n < context->fds_count - 1) {
-			context->fds[n] = context->fds[n + 1];
-			n++;
-		}
-		context->fds_count--;
-		/* we only have to deal with one */
-		n = context->fds_count;
-	}
+	wsi->state = WSI_STATE_DEAD_SOCKET;
+	lws_protocol_leave(wsi);
 
-	/* remove also from external POLL support via protocol 0 */
-	if (wsi->sock)
-		context->protocols[0].callback(context, wsi,
-		    LWS_CALLBACK_DEL_POLL_FD, (void *)(long)wsi->sock, NULL, 0);
+	/* anything still waiting to go out is lost with the connection */
 
-	wsi->state = WSI_STATE_DEAD_SOCKET;
+	lws_tx_queue_free(wsi);
+	lws_rx_buffer_free(wsi);
+	lws_rx_message_free(wsi);
 
 	/* tell the user it's all over for this guy */
 
@@ -361,9 +571,10 @@ just_kill_connection:
 
 	/* free up his parsing allocations */
 
-	for (n = 0; n < WSI_TOKEN_COUNT; n++)
-		if (wsi->utf8_token[n].token)
-			free(wsi->utf8_token[n].token);
+	if (wsi->hdr_buf)
+		free(wsi->hdr_buf);
+	if (wsi->user_token)
+		free(wsi->user_token);
 
 	if (wsi->c_address)
 		free(wsi->c_address);
@@ -396,6 +607,8 @@ just_kill_connection:
 	if (wsi->protocol && wsi->protocol->per_session_data_size && wsi->user_space) /* user code may own */
 		free(wsi->user_space);
 
+	lws_timeouts_unlink(context, wsi);
+
 	free(wsi);
 }
 
@@ -496,6 +709,43 @@ libwebsockets_get_peer_addresses(int fd, char *name, int name_len,
 	}
 }
 
+#ifndef WIN32
+static int
+lws_random_fill(struct libwebsocket_context *context, unsigned char *p,
+								       int len)
+{
+	int done = 0;
+	int n;
+
+	while (done < len) {
+#ifdef LWS_HAS_GETRANDOM
+		if (context->fd_random < 0)
+			n = syscall(SYS_getrandom, p + done, len - done, 0);
+		else
+#endif
+			n = read(context->fd_random, p + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+
+	return done;
+}
+#endif
+
+/**
+ * libwebsockets_get_random() - fill a buffer with random bytes
+ * @context:	Websocket context
+ * @buf:	buffer to fill
+ * @len:	count of bytes wanted
+ *
+ *	Small requests like masking keys and handshake keys are served
+ *	from a per-context pool that is refilled in bulk, so they don't
+ *	cost a syscall each.  Returns @len on success.
+ */
+
 int libwebsockets_get_random(struct libwebsocket_context *context,
 							     void *buf, int len)
 {
@@ -506,7 +756,20 @@ int libwebsockets_get_random(struct libwebsocket_context *context,
 	for (n = 0; n < len; n++)
 		p[n] = (unsigned char)rand();
 #else
-	n = read(context->fd_random, p, len);
+	if (len > LWS_RANDOM_POOL_SIZE / 4)
+		return lws_random_fill(context, (unsigned char *)p, len);
+
+	if (context->random_pool_pos + len > LWS_RANDOM_POOL_SIZE) {
+		n = lws_random_fill(context, context->random_pool,
+							 LWS_RANDOM_POOL_SIZE);
+		if (n != LWS_RANDOM_POOL_SIZE)
+			return -1;
+		context->random_pool_pos = 0;
+	}
+
+	memcpy(p, &context->random_pool[context->random_pool_pos], len);
+	context->random_pool_pos += len;
+	n = len;
 #endif
 
 	return n;
@@ -561,21 +824,13 @@ void libwebsockets_00_spam(char *key, int count, int seed)
 
 int lws_send_pipe_choked(struct libwebsocket *wsi)
 {
-	struct pollfd fds;
-
-	fds.fd = wsi->sock;
-	fds.events = POLLOUT;
-	fds.revents = 0;
-
-	if (poll(&fds, 1, 0) != 1)
-		return 1;
-
-	if ((fds.revents & POLLOUT) == 0)
-		return 1;
-
-	/* okay to send another packet without blocking */
+	/*
+	 * lws_issue_raw() records whether the kernel took everything we
+	 * gave it on the last send, and it stays choked while anything is
+	 * left on the tx queue, so this costs no syscall
+	 */
 
-	return 0;
+	return wsi->send_choked;
 }
 
 int
@@ -588,6 +843,10 @@ lws_handle_POLLOUT_event(struct libwebsocket_context *context,
 	int m;
 	int handled = 0;
 
+	/* this is the writeable event the user was waiting for */
+
+	wsi->writeable_requested = 0;
+
 	for (n = 0; n < wsi->count_active_extensions; n++) {
 		if (!wsi->active_extensions[n]->callback)
 			continue;
@@ -686,10 +945,8 @@ user_service:
 	if (pollfd) {
 		pollfd->events &= ~POLLOUT;
 
-		/* external POLL support via protocol 0 */
-		context->protocols[0].callback(context, wsi,
-			LWS_CALLBACK_CLEAR_MODE_POLL_FD,
-			(void *)(long)wsi->sock, NULL, POLLOUT);
+		/* internal poll array, epoll and external POLL support */
+		lws_change_pollfd(context, wsi, POLLOUT, 0);
 	}
 
 notify_action:
@@ -706,83 +963,326 @@ notify_action:
 
 
 
-void
-libwebsocket_service_timeout_check(struct libwebsocket_context *context,
-				     struct libwebsocket *wsi, unsigned int sec)
+/*
+ * connection timeouts
+ *
+ * Pending timeouts are kept on a hierarchical timer wheel with one second
+ * ticks.  Each level has 64 slots and covers 64 times the span of the one
+ * below; entries on the upper levels are moved down when their slot comes
+ * round.  So a tick only touches connections that are due, and a bitmap of
+ * occupied slots per level tells us when the next tick worth doing is.
+ */
+
+static int
+lws_timer_lowest_bit(unsigned long long bits)
 {
-	int n;
+#ifdef __GNUC__
+	return __builtin_ctzll(bits);
+#else
+	int n = 0;
 
-	/*
-	 * if extensions want in on it (eg, we are a mux parent)
-	 * give them a chance to service child timeouts
-	 */
+	while (!(bits & 1)) {
+		bits >>= 1;
+		n++;
+	}
 
-	for (n = 0; n < wsi->count_active_extensions; n++)
-		wsi->active_extensions[n]->callback(
-				    context, wsi->active_extensions[n],
-				    wsi, LWS_EXT_CALLBACK_1HZ,
-				    wsi->active_extensions_user[n], NULL, sec);
+	return n;
+#endif
+}
 
-	if (!wsi->pending_timeout)
+static void
+lws_timer_unlink(struct lws_timer_wheel *tw, struct libwebsocket *wsi)
+{
+	if (wsi->timeout_prev == NULL)
 		return;
 
+	*wsi->timeout_prev = wsi->timeout_next;
+	if (wsi->timeout_next)
+		wsi->timeout_next->timeout_prev = wsi->timeout_prev;
+	if (tw->slot[wsi->timeout_level][wsi->timeout_slot] == NULL)
+		tw->occupied[wsi->timeout_level] &=
+					      ~(1ULL << wsi->timeout_slot);
+
+	wsi->timeout_next = NULL;
+	wsi->timeout_prev = NULL;
+}
+
+static void
+lws_timer_link(struct lws_timer_wheel *tw, struct libwebsocket *wsi,
+							 unsigned long expires)
+{
+	struct libwebsocket **head;
+	unsigned long delta;
+	int level = 0;
+
+	if (expires < tw->now)
+		expires = tw->now;
+	delta = expires - tw->now;
+
 	/*
-	 * if we went beyond the allowed time, kill the
-	 * connection
+	 * too far out for the top level: park it in the furthest slot, it
+	 * is linked again from there when that comes round
 	 */
 
-	if (sec > wsi->pending_timeout_limit) {
-		debug("TIMEDOUT WAITING\n");
-		libwebsocket_close_and_free_session(context,
-				wsi, LWS_CLOSE_STATUS_NOSTATUS);
+	if (delta >> (LWS_TIMER_WHEEL_BITS * LWS_TIMER_WHEEL_LEVELS)) {
+		delta = (1UL << (LWS_TIMER_WHEEL_BITS *
+					       LWS_TIMER_WHEEL_LEVELS)) - 1;
+		expires = tw->now + delta;
 	}
+
+	while (level < LWS_TIMER_WHEEL_LEVELS - 1 &&
+		      delta >> (LWS_TIMER_WHEEL_BITS * (level + 1)))
+		level++;
+
+	wsi->timeout_level = level;
+	wsi->timeout_slot = (expires >> (LWS_TIMER_WHEEL_BITS * level)) &
+							   LWS_TIMER_WHEEL_MASK;
+
+	head = &tw->slot[level][wsi->timeout_slot];
+	wsi->timeout_next = *head;
+	if (*head)
+		(*head)->timeout_prev = &wsi->timeout_next;
+	*head = wsi;
+	wsi->timeout_prev = head;
+	tw->occupied[level] |= 1ULL << wsi->timeout_slot;
 }
 
-struct libwebsocket *
-libwebsocket_create_new_server_wsi(struct libwebsocket_context *context)
+/*
+ * lws_timer_next() - find the next second after tw->now where anything
+ *		      on the wheel needs doing.  Returns 0 if the wheel is empty.
+ */
+
+static int
+lws_timer_next(struct lws_timer_wheel *tw, unsigned long *next)
 {
-	struct libwebsocket *new_wsi;
-	int n;
+	unsigned long long bits = tw->occupied[0];
+	int found = 0;
+	int level;
+	int r;
+
+	if (bits) {
+		/* rotate so bit 0 is the slot for tw->now + 1 */
+		r = (tw->now + 1) & LWS_TIMER_WHEEL_MASK;
+		if (r)
+			bits = (bits >> r) | (bits << (LWS_TIMER_WHEEL_SLOTS - r));
+		*next = tw->now + 1 + lws_timer_lowest_bit(bits);
+		found = 1;
+	}
 
-	new_wsi = malloc(sizeof(struct libwebsocket));
-	if (new_wsi == NULL) {
-		fprintf(stderr, "Out of memory for new connection\n");
-		return NULL;
+	/* anything higher up needs us to stop at the next cascade point */
+
+	for (level = 1; level < LWS_TIMER_WHEEL_LEVELS; level++) {
+		if (!tw->occupied[level])
+			continue;
+		r = (((tw->now >> LWS_TIMER_WHEEL_BITS) + 1) <<
+						       LWS_TIMER_WHEEL_BITS) - tw->now;
+		if (!found || tw->now + r < *next)
+			*next = tw->now + r;
+		found = 1;
+		break;
 	}
 
-	memset(new_wsi, 0, sizeof(struct libwebsocket));
-	new_wsi->count_active_extensions = 0;
-	new_wsi->pending_timeout = NO_PENDING_TIMEOUT;
+	return found;
+}
 
-	/* intialize the instance struct */
+static void
+lws_timer_tick(struct libwebsocket_context *context)
+{
+	struct lws_timer_wheel *tw = &context->timer_wheel;
+	struct libwebsocket **head;
+	struct libwebsocket *wsi;
+	int level;
 
-	new_wsi->state = WSI_STATE_HTTP;
-	new_wsi->name_buffer_pos = 0;
-	new_wsi->mode = LWS_CONNMODE_WS_SERVING;
+	/* move down anything from upper level slots that came round */
 
-	for (n = 0; n < WSI_TOKEN_COUNT; n++) {
-		new_wsi->utf8_token[n].token = NULL;
-		new_wsi->utf8_token[n].token_len = 0;
+	for (level = LWS_TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+		if (tw->now & ((1UL << (LWS_TIMER_WHEEL_BITS * level)) - 1))
+			continue;
+		head = &tw->slot[level][(tw->now >> (LWS_TIMER_WHEEL_BITS *
+					      level)) & LWS_TIMER_WHEEL_MASK];
+		while ((wsi = *head)) {
+			lws_timer_unlink(tw, wsi);
+			lws_timer_link(tw, wsi, wsi->pending_timeout_limit + 1);
+		}
 	}
 
-	/*
-	 * these can only be set once the protocol is known
-	 * we set an unestablished connection's protocol pointer
-	 * to the start of the supported list, so it can look
-	 * for matching ones during the handshake
-	 */
-	new_wsi->protocol = context->protocols;
-	new_wsi->user_space = NULL;
-
-	/*
-	 * Default protocol is 76 / 00
-	 * After 76, there's a header specified to inform which
-	 * draft the client wants, when that's seen we modify
-	 * the individual connection's spec revision accordingly
-	 */
-	new_wsi->ietf_spec_revision = 0;
+	/* and kill whoever went beyond their allowed time */
 
-	return new_wsi;
+	head = &tw->slot[0][tw->now & LWS_TIMER_WHEEL_MASK];
+	while ((wsi = *head)) {
+		lws_timer_unlink(tw, wsi);
+		if (tw->now <= wsi->pending_timeout_limit) {
+			/* was parked at the top, not due yet */
+			lws_timer_link(tw, wsi, wsi->pending_timeout_limit + 1);
+			continue;
+		}
+		debug("TIMEDOUT WAITING\n");
+		wsi->pending_timeout = NO_PENDING_TIMEOUT;
+		libwebsocket_close_and_free_session(context,
+				wsi, LWS_CLOSE_STATUS_NOSTATUS);
+	}
+}
+
+void
+lws_timeouts_unlink(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi)
+{
+	lws_timer_unlink(&context->timer_wheel, wsi);
+
+	if (wsi->ext_1hz_prev == NULL)
+		return;
+
+	*wsi->ext_1hz_prev = wsi->ext_1hz_next;
+	if (wsi->ext_1hz_next)
+		wsi->ext_1hz_next->ext_1hz_prev = wsi->ext_1hz_prev;
+	wsi->ext_1hz_next = NULL;
+	wsi->ext_1hz_prev = NULL;
+}
+
+/*
+ * lws_ext_1hz_add() - called when a connection gets an active extension,
+ *		       so it is included in the LWS_EXT_CALLBACK_1HZ calls
+ */
+
+void
+lws_ext_1hz_add(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi)
+{
+	if (wsi->ext_1hz_prev)
+		return;
+
+	wsi->ext_1hz_next = context->ext_1hz_list;
+	if (context->ext_1hz_list)
+		context->ext_1hz_list->ext_1hz_prev = &wsi->ext_1hz_next;
+	context->ext_1hz_list = wsi;
+	wsi->ext_1hz_prev = &context->ext_1hz_list;
+}
+
+static void
+lws_service_timeouts(struct libwebsocket_context *context, unsigned long sec)
+{
+	struct lws_timer_wheel *tw = &context->timer_wheel;
+	struct libwebsocket *wsi;
+	struct libwebsocket *next_wsi;
+	unsigned long next;
+	int n;
+
+	if (context->last_timeout_check_s == sec)
+		return;
+	context->last_timeout_check_s = sec;
+
+	/* extensions get a look in once a second */
+
+	for (wsi = context->ext_1hz_list; wsi; wsi = next_wsi) {
+		next_wsi = wsi->ext_1hz_next;
+		for (n = 0; n < wsi->count_active_extensions; n++)
+			wsi->active_extensions[n]->callback(
+				    context, wsi->active_extensions[n],
+				    wsi, LWS_EXT_CALLBACK_1HZ,
+				    wsi->active_extensions_user[n], NULL, sec);
+	}
+
+	/* receive buffers nobody has used for a while go back */
+
+	lws_rx_buffers_idle(context);
+
+	/* bring the wheel up to date, skipping over seconds with no work */
+
+	while (tw->now < sec) {
+		if (!lws_timer_next(tw, &next) || next > sec) {
+			tw->now = sec;
+			break;
+		}
+		tw->now = next;
+		lws_timer_tick(context);
+	}
+}
+
+/*
+ * lws_timeout_until_due() - shorten a service wait to end when the next
+ *			     timeout or once-a-second check is due
+ */
+
+static int
+lws_timeout_until_due(struct libwebsocket_context *context, int timeout_ms)
+{
+	struct timeval tv;
+	unsigned long next;
+	int each_second;
+	int ms;
+
+	/* extension 1Hz callbacks and rx buffer idling need every second */
+
+	each_second = context->ext_1hz_list || context->rx_buffer_list;
+
+	if (!lws_timer_next(&context->timer_wheel, &next)) {
+		if (!each_second)
+			return timeout_ms;
+		next = context->timer_wheel.now + 1;
+	} else if (each_second && next > context->timer_wheel.now + 1)
+		next = context->timer_wheel.now + 1;
+
+	gettimeofday(&tv, NULL);
+
+	if (next <= (unsigned long)tv.tv_sec)
+		return 0;
+
+	if (next - tv.tv_sec > (unsigned long)INT_MAX / 1000)
+		return timeout_ms;
+
+	ms = (next - tv.tv_sec) * 1000 - tv.tv_usec / 1000;
+	if (timeout_ms >= 0 && timeout_ms < ms)
+		return timeout_ms;
+
+	return ms;
+}
+
+struct libwebsocket *
+libwebsocket_create_new_server_wsi(struct libwebsocket_context *context)
+{
+	struct libwebsocket *new_wsi;
+	int n;
+
+	new_wsi = malloc(sizeof(struct libwebsocket));
+	if (new_wsi == NULL) {
+		fprintf(stderr, "Out of memory for new connection\n");
+		return NULL;
+	}
+
+	memset(new_wsi, 0, sizeof(struct libwebsocket));
+	new_wsi->position_in_fds_table = -1;
+	new_wsi->count_active_extensions = 0;
+	new_wsi->pending_timeout = NO_PENDING_TIMEOUT;
+
+	/* intialize the instance struct */
+
+	new_wsi->state = WSI_STATE_HTTP;
+	new_wsi->name_buffer_pos = 0;
+	new_wsi->mode = LWS_CONNMODE_WS_SERVING;
+
+	for (n = 0; n < WSI_TOKEN_COUNT; n++) {
+		new_wsi->utf8_token[n].token = NULL;
+		new_wsi->utf8_token[n].token_len = 0;
+	}
+
+	/*
+	 * these can only be set once the protocol is known
+	 * we set an unestablished connection's protocol pointer
+	 * to the start of the supported list, so it can look
+	 * for matching ones during the handshake
+	 */
+	new_wsi->protocol = context->protocols;
+	new_wsi->user_space = NULL;
+
+	/*
+	 * Default protocol is 76 / 00
+	 * After 76, there's a header specified to inform which
+	 * draft the client wants, when that's seen we modify
+	 * the individual connection's spec revision accordingly
+	 */
+	new_wsi->ietf_spec_revision = 0;
+
+	return new_wsi;
 }
 
 char *
@@ -861,8 +1361,11 @@ libwebsockets_generate_client_handshake(struct libwebsocket_context *context,
 		unsigned int count;
 		char challenge[16];
 
-		libwebsockets_get_random(context, &spaces_1, sizeof(char));
-		libwebsockets_get_random(context, &spaces_2, sizeof(char));
+		if (libwebsockets_get_random(context, &spaces_1,
+						  sizeof(char)) != sizeof(char) ||
+		    libwebsockets_get_random(context, &spaces_2,
+						  sizeof(char)) != sizeof(char))
+			goto random_failed;
 
 		spaces_1 = (spaces_1 % 12) + 1;
 		spaces_2 = (spaces_2 % 12) + 1;
@@ -870,8 +1373,11 @@ libwebsockets_generate_client_handshake(struct libwebsocket_context *context,
 		max_1 = 4294967295 / spaces_1;
 		max_2 = 4294967295 / spaces_2;
 
-		libwebsockets_get_random(context, &num_1, sizeof(int));
-		libwebsockets_get_random(context, &num_2, sizeof(int));
+		if (libwebsockets_get_random(context, &num_1,
+						    sizeof(int)) != sizeof(int) ||
+		    libwebsockets_get_random(context, &num_2,
+						    sizeof(int)) != sizeof(int))
+			goto random_failed;
 
 		num_1 = (num_1 % max_1);
 		num_2 = (num_2 % max_2);
@@ -891,17 +1397,25 @@ libwebsockets_generate_client_handshake(struct libwebsocket_context *context,
 		sprintf(key_1, "%lu", product_1);
 		sprintf(key_2, "%lu", product_2);
 
-		libwebsockets_get_random(context, &seed, sizeof(int));
-		libwebsockets_get_random(context, &count, sizeof(int));
+		if (libwebsockets_get_random(context, &seed,
+						    sizeof(int)) != sizeof(int) ||
+		    libwebsockets_get_random(context, &count,
+						    sizeof(int)) != sizeof(int))
+			goto random_failed;
 
 		libwebsockets_00_spam(key_1, (count % 12) + 1, seed);
 
-		libwebsockets_get_random(context, &seed, sizeof(int));
-		libwebsockets_get_random(context, &count, sizeof(int));
+		if (libwebsockets_get_random(context, &seed,
+						    sizeof(int)) != sizeof(int) ||
+		    libwebsockets_get_random(context, &count,
+						    sizeof(int)) != sizeof(int))
+			goto random_failed;
 
 		libwebsockets_00_spam(key_2, (count % 12) + 1, seed);
 
-		libwebsockets_get_random(context, &seed, sizeof(int));
+		if (libwebsockets_get_random(context, &seed,
+						    sizeof(int)) != sizeof(int))
+			goto random_failed;
 
 		libwebsockets_00_spaceout(key_1, spaces_1, seed);
 		libwebsockets_00_spaceout(key_2, spaces_2, seed >> 16);
@@ -1043,6 +1557,11 @@ issue_hdr:
 		free(wsi->c_origin);
 
 	return p;
+
+random_failed:
+	fprintf(stderr, "Unable to read from random device %s\n",
+						       SYSTEM_RANDOM_FILEPATH);
+	return NULL;
 }
 
 int
@@ -1324,6 +1843,7 @@ select_protocol:
 								   NULL, 0);
 
 			wsi->count_active_extensions++;
+			lws_ext_1hz_add(context, wsi);
 
 			ext++;
 		}
@@ -1389,12 +1909,14 @@ accept_ok:
 
 	/* clear his proxy connection timeout */
 
-	libwebsocket_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
+	libwebsocket_set_timeout(context, wsi,
+							NO_PENDING_TIMEOUT, 0);
 
 	/* mark him as being alive */
 
 	wsi->state = WSI_STATE_ESTABLISHED;
 	wsi->mode = LWS_CONNMODE_WS_CLIENT;
+	lws_protocol_join(wsi);
 
 	debug("handshake OK for protocol %s\n", wsi->protocol->name);
 
@@ -1441,327 +1963,980 @@ bail2:
 
 
 
-/**
- * libwebsocket_service_fd() - Service polled socket with something waiting
- * @context:	Websocket context
- * @pollfd:	The pollfd entry describing the socket fd and which events
- *		happened.
+/*
+ * cross-thread tasks
  *
- *	This function closes any active connections and then frees the
- *	context.  After calling this, any further use of the context is
- *	undefined.
+ * Other threads can't touch a context's connections directly, instead
+ * they post tasks here.  Posting pushes onto a lock-free list with
+ * compare-and-swap; the service loop swaps the whole list out in one go
+ * and runs it in posting order.  The post that finds the list empty wakes
+ * the loop through an eventfd (or pipe) which sits in the poll set as a
+ * dummy connection.
  */
 
-int
-libwebsocket_service_fd(struct libwebsocket_context *context,
-							  struct pollfd *pollfd)
+#ifdef LWS_HAS_TASK_QUEUE
+
+static void
+lws_task_wakeup(struct libwebsocket_context *context)
 {
-	unsigned char buf[LWS_SEND_BUFFER_PRE_PADDING + 1 +
-			 MAX_BROADCAST_PAYLOAD + LWS_SEND_BUFFER_POST_PADDING];
-	struct libwebsocket *wsi;
-	struct libwebsocket *new_wsi;
-	int n;
-	int m;
-	ssize_t len;
-	int accept_fd;
-	unsigned int clilen;
-	struct sockaddr_in cli_addr;
-	struct timeval tv;
-	char pkt[1024];
-	char *p = &pkt[0];
-	int more = 1;
-	struct lws_tokens eff_buf;
-	int opt = 1;
-	char c;
+	unsigned long long one = 1;
 
-#ifdef LWS_OPENSSL_SUPPORT
-	char ssl_err_buf[512];
-#endif
-	/*
-	 * you can call us with pollfd = NULL to just allow the once-per-second
-	 * global timeout checks; if less than a second since the last check
-	 * it returns immediately then.
-	 */
+	if (write(context->task_wakeup_fd[1], &one, sizeof one) < 0)
+		debug("task wakeup write failed: %d\n", errno);
+}
 
-	gettimeofday(&tv, NULL);
+static int
+lws_post_task(struct libwebsocket_context *context, struct lws_task *task)
+{
+	struct lws_task *head = NULL;
+	struct lws_task *old;
+
+	for (;;) {
+		task->next = head;
+		old = __sync_val_compare_and_swap(&context->task_queue,
+								   head, task);
+		if (old == head)
+			break;
+		head = old;
+	}
 
-	if (context->last_timeout_check_s != tv.tv_sec) {
-		context->last_timeout_check_s = tv.tv_sec;
+	/* only the first task since the loop last looked needs to wake it */
 
-		/* global timeout check once per second */
+	if (head == NULL)
+		lws_task_wakeup(context);
 
-		for (n = 0; n < context->fds_count; n++) {
-			wsi = wsi_from_fd(context, context->fds[n].fd);
+	return 0;
+}
 
-			libwebsocket_service_timeout_check(context, wsi,
-								     tv.tv_sec);
-		}
-	}
+/*
+ * the connection a task was posted for, or NULL if it has closed since.
+ * The serial half of the id stops a later connection that happens to get
+ * the same fd from being mistaken for it.
+ */
 
-	/* just here for timeout management? */
+static struct libwebsocket *
+lws_task_wsi(struct libwebsocket_context *context, struct lws_task *task)
+{
+	struct libwebsocket *wsi;
 
-	if (pollfd == NULL)
-		return 0;
+	wsi = wsi_from_fd(context, (int)(task->connection_id & 0xffffffff));
+	if (wsi == NULL || wsi->connection_id != task->connection_id ||
+					   wsi->state != WSI_STATE_ESTABLISHED)
+		return NULL;
 
-	/* no, here to service a socket descriptor */
+	return wsi;
+}
 
-	wsi = wsi_from_fd(context, pollfd->fd);
+static void
+lws_service_tasks(struct libwebsocket_context *context)
+{
+	struct lws_task *task;
+	struct lws_task *next;
+	struct lws_task *list = NULL;
+	struct libwebsocket *wsi;
+	unsigned char drain[64];
 
-	if (wsi == NULL)
-		return 1;
+	/*
+	 * clear the wakeup before taking the list, anything posted after
+	 * that finds the list empty and wakes us again
+	 */
 
-	switch (wsi->mode) {
-	case LWS_CONNMODE_SERVER_LISTENER:
+	while (read(context->task_wakeup_fd[0], drain, sizeof drain) > 0)
+		;
 
-		/* pollin means a client has connected to us then */
+	task = __sync_lock_test_and_set(&context->task_queue, NULL);
 
-		if (!pollfd->revents & POLLIN)
-			break;
+	/* it was pushed newest first */
 
-		if (context->fds_count >= MAX_CLIENTS) {
-			fprintf(stderr, "too busy to accept new client\n");
-			break;
-		}
+	while (task) {
+		next = task->next;
+		task->next = list;
+		list = task;
+		task = next;
+	}
 
-		/* listen socket got an unencrypted connection... */
+	while (list) {
+		task = list;
+		list = task->next;
 
-		clilen = sizeof(cli_addr);
-		accept_fd  = accept(pollfd->fd, (struct sockaddr *)&cli_addr,
-								       &clilen);
-		if (accept_fd < 0) {
-			debug("ERROR on accept\n");
-			return -1;
+		switch (task->type) {
+		case LWS_TASK_WRITE:
+			wsi = lws_task_wsi(context, task);
+			if (wsi == NULL)
+				break;
+			if (libwebsocket_write(wsi,
+				   task->buf + LWS_SEND_BUFFER_PRE_PADDING,
+					     task->len, task->protocol) < 0) {
+				debug("posted write failed\n");
+				libwebsocket_close_and_free_session(context,
+					    wsi, LWS_CLOSE_STATUS_NOSTATUS);
+			}
+			break;
+		case LWS_TASK_CALLBACK_ON_WRITABLE:
+			wsi = lws_task_wsi(context, task);
+			if (wsi)
+				libwebsocket_callback_on_writable(context, wsi);
+			break;
+		case LWS_TASK_CLOSURE:
+			task->closure(context, task->arg);
+			break;
 		}
 
-		/* Disable Nagle */
-		opt = 1;
-		setsockopt(accept_fd, IPPROTO_TCP, TCP_NODELAY,
-					      (const void *)&opt, sizeof(opt));
+		free(task);
+	}
+}
 
-		/*
-		 * look at who we connected to and give user code a chance
-		 * to reject based on client IP.  There's no protocol selected
-		 * yet so we issue this to protocols[0]
-		 */
+/*
+ * lws_init_task_queue() - create the wakeup descriptor and its dummy wsi
+ */
 
-		if ((context->protocols[0].callback)(context, wsi,
-				LWS_CALLBACK_FILTER_NETWORK_CONNECTION,
-					   (void *)(long)accept_fd, NULL, 0)) {
-			debug("Callback denied network connection\n");
-#ifdef WIN32
-			closesocket(accept_fd);
-#else
-			close(accept_fd);
+static int
+lws_init_task_queue(struct libwebsocket_context *context)
+{
+	struct libwebsocket *wsi;
+#ifndef LWS_HAS_EVENTFD
+	int n;
 #endif
-			break;
-		}
-
-		/* accepting connection to main listener */
-
-		new_wsi = libwebsocket_create_new_server_wsi(context);
-		if (new_wsi == NULL)
-			break;
 
-		new_wsi->sock = accept_fd;
+	context->task_queue = NULL;
 
+#ifdef LWS_HAS_EVENTFD
+	context->task_wakeup_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (context->task_wakeup_fd[0] < 0) {
+		fprintf(stderr, "Unable to create task eventfd: %s\n",
+							       strerror(errno));
+		return 1;
+	}
+	context->task_wakeup_fd[1] = context->task_wakeup_fd[0];
+#else
+	if (pipe(context->task_wakeup_fd)) {
+		fprintf(stderr, "Unable to create task pipe: %s\n",
+							       strerror(errno));
+		return 1;
+	}
+	for (n = 0; n < 2; n++) {
+		lws_set_nonblocking(context->task_wakeup_fd[n], 1);
+		fcntl(context->task_wakeup_fd[n], F_SETFD, FD_CLOEXEC);
+	}
+#endif
 
-#ifdef LWS_OPENSSL_SUPPORT
-		new_wsi->ssl = NULL;
+	wsi = malloc(sizeof(struct libwebsocket));
+	if (wsi == NULL) {
+		fprintf(stderr, "Out of memory for task wakeup\n");
+		return 1;
+	}
+	memset(wsi, 0, sizeof(struct libwebsocket));
+	wsi->position_in_fds_table = -1;
+	wsi->sock = context->task_wakeup_fd[0];
+	wsi->mode = LWS_CONNMODE_TASK_WAKEUP;
 
-		if (context->use_ssl) {
+	return insert_wsi_socket_into_fds(context, wsi);
+}
 
-			new_wsi->ssl = SSL_new(context->ssl_ctx);
-			if (new_wsi->ssl == NULL) {
-				fprintf(stderr, "SSL_new failed: %s\n",
-				    ERR_error_string(SSL_get_error(
-				    new_wsi->ssl, 0), NULL));
-				    libwebsockets_decode_ssl_error();
-				free(new_wsi);
-				break;
-			}
+static void
+lws_destroy_task_queue(struct libwebsocket_context *context)
+{
+	struct lws_task *task;
+	struct lws_task *next;
 
-			SSL_set_fd(new_wsi->ssl, accept_fd);
+	/* the read side went with its dummy wsi */
 
-			n = SSL_accept(new_wsi->ssl);
-			if (n != 1) {
-				/*
-				 * browsers seem to probe with various
-				 * ssl params which fail then retry
-				 * and succeed
-				 */
-				debug("SSL_accept failed skt %u: %s\n",
-				      pollfd->fd,
-				      ERR_error_string(SSL_get_error(
-				      new_wsi->ssl, n), NULL));
-				SSL_free(
-				       new_wsi->ssl);
-				free(new_wsi);
-				break;
-			}
+	if (context->task_wakeup_fd[1] != context->task_wakeup_fd[0])
+		close(context->task_wakeup_fd[1]);
 
-			debug("accepted new SSL conn  "
-			      "port %u on fd=%d SSL ver %s\n",
-				ntohs(cli_addr.sin_port), accept_fd,
-				  SSL_get_version(new_wsi->ssl));
+	for (task = context->task_queue; task; task = next) {
+		next = task->next;
+		free(task);
+	}
+}
 
-		} else
 #endif
-			debug("accepted new conn  port %u on fd=%d\n",
-					  ntohs(cli_addr.sin_port), accept_fd);
 
-		insert_wsi(context, new_wsi);
+/**
+ * libwebsocket_post_write() - Send data on a connection from another thread
+ *
+ * @context:	libwebsockets context the connection belongs to
+ * @connection_id:	libwebsocket_get_connection_id() of the connection
+ * @buf:	The data to send, no padding needed, it is copied
+ * @len:	Count of the data bytes
+ * @protocol:	Write type as for libwebsocket_write()
+ *
+ *	This is the thread-safe version of libwebsocket_write(): the data is
+ *	queued and written by the thread servicing @context.  If the
+ *	connection has closed by the time the write comes to be done, it is
+ *	dropped.
+ *
+ *	Returns 0 if the write was queued.
+ */
 
-		/*
-		 * make sure NO events are seen yet on this new socket
-		 * (otherwise we inherit old fds[client].revents from
-		 * previous socket there and die mysteriously! )
-		 */
-		context->fds[context->fds_count].revents = 0;
+int
+libwebsocket_post_write(struct libwebsocket_context *context,
+		unsigned long long connection_id, const unsigned char *buf,
+			 size_t len, enum libwebsocket_write_protocol protocol)
+{
+#ifdef LWS_HAS_TASK_QUEUE
+	struct lws_task *task;
 
-		context->fds[context->fds_count].events = POLLIN;
-		context->fds[context->fds_count++].fd = accept_fd;
+	task = malloc(sizeof(*task) + LWS_SEND_BUFFER_PRE_PADDING + len +
+						 LWS_SEND_BUFFER_POST_PADDING);
+	if (task == NULL)
+		return -1;
 
-		/* external POLL support via protocol 0 */
-		context->protocols[0].callback(context, new_wsi,
-			LWS_CALLBACK_ADD_POLL_FD,
-			(void *)(long)accept_fd, NULL, POLLIN);
+	task->type = LWS_TASK_WRITE;
+	task->connection_id = connection_id;
+	task->buf = (unsigned char *)(task + 1);
+	memcpy(task->buf + LWS_SEND_BUFFER_PRE_PADDING, buf, len);
+	task->len = len;
+	task->protocol = protocol;
 
-		break;
+	return lws_post_task(context, task);
+#else
+	return -1;
+#endif
+}
 
-	case LWS_CONNMODE_BROADCAST_PROXY_LISTENER:
+/**
+ * libwebsocket_post_callback_on_writable() - Request a writable callback
+ *					      from another thread
+ *
+ * @context:	libwebsockets context the connection belongs to
+ * @connection_id:	libwebsocket_get_connection_id() of the connection
+ *
+ *	Thread-safe version of libwebsocket_callback_on_writable(), the
+ *	request is passed to the thread servicing @context.  It is dropped if
+ *	the connection has closed in the meanwhile.
+ */
 
-		/* as we are listening, POLLIN means accept() is needed */
+int
+libwebsocket_post_callback_on_writable(struct libwebsocket_context *context,
+					      unsigned long long connection_id)
+{
+#ifdef LWS_HAS_TASK_QUEUE
+	struct lws_task *task;
 
-		if (!pollfd->revents & POLLIN)
-			break;
+	task = malloc(sizeof(*task));
+	if (task == NULL)
+		return -1;
 
-		/* listen socket got an unencrypted connection... */
+	task->type = LWS_TASK_CALLBACK_ON_WRITABLE;
+	task->connection_id = connection_id;
 
-		clilen = sizeof(cli_addr);
-		accept_fd  = accept(pollfd->fd, (struct sockaddr *)&cli_addr,
-								       &clilen);
-		if (accept_fd < 0) {
-			debug("ERROR on accept\n");
-			return -1;
-		}
+	return lws_post_task(context, task);
+#else
+	return -1;
+#endif
+}
+
+/**
+ * libwebsocket_post_closure() - Run a function in the service thread
+ *
+ * @context:	libwebsockets context
+ * @closure:	Function to call
+ * @arg:	Argument passed to @closure along with @context
+ *
+ *	Queues @closure to be called by the thread servicing @context, where
+ *	it may use any libwebsockets api on the connections of @context.
+ *	Closures still queued when the context is destroyed are not called.
+ */
+
+int
+libwebsocket_post_closure(struct libwebsocket_context *context,
+			     libwebsocket_task_function *closure, void *arg)
+{
+#ifdef LWS_HAS_TASK_QUEUE
+	struct lws_task *task;
+
+	task = malloc(sizeof(*task));
+	if (task == NULL)
+		return -1;
+
+	task->type = LWS_TASK_CLOSURE;
+	task->closure = closure;
+	task->arg = arg;
+
+	return lws_post_task(context, task);
+#else
+	return -1;
+#endif
+}
+
+/*
+ * lws_broadcast_to_members() - LWS_CALLBACK_BROADCAST to a protocol's
+ *				established server connections
+ */
+
+static void
+lws_broadcast_to_members(struct libwebsocket_context *context,
+		   const struct libwebsocket_protocols *protocol,
+					    unsigned char *buf, size_t len)
+{
+	struct libwebsocket *wsi;
+	struct libwebsocket *next;
+
+	for (wsi = protocol->established_list; wsi; wsi = next) {
+
+		/* he may close himself in the callback */
+
+		next = wsi->protocol_next;
+
+		if (wsi->mode != LWS_CONNMODE_WS_SERVING)
+			continue;
+
+		/*
+		 * never broadcast to connections that are on their way out
+		 */
+		if (wsi->state != WSI_STATE_ESTABLISHED)
+			continue;
+
+		wsi->protocol->callback(context, wsi, LWS_CALLBACK_BROADCAST,
+						    wsi->user_space, buf, len);
+	}
+}
+
+#ifndef LWS_NO_FORK
+
+/*
+ * broadcast ring
+ *
+ * The process libwebsockets_fork_service_loop() returns to hands broadcast
+ * payloads to the service process through a ring in shared memory, one
+ * record per libwebsockets_broadcast() so message boundaries are kept.  An
+ * eventfd (or a pipe) tells the service process there is something there.
+ */
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define lws_broadcast_record_space(len) \
+	((sizeof(struct lws_broadcast_record) + (len) + 7) & ~7UL)
+
+static int
+lws_init_broadcast_ring(struct libwebsocket_context *context)
+{
+	struct lws_broadcast_ring *ring;
+#ifndef LWS_HAS_EVENTFD
+	int n;
+#endif
+
+	ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE,
+					    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		fprintf(stderr, "Unable to map broadcast ring: %s\n",
+							       strerror(errno));
+		return 1;
+	}
+	ring->lock = 0;
+	ring->head = 0;
+	ring->tail = 0;
+
+#ifdef LWS_HAS_EVENTFD
+	context->broadcast_ring_fd[0] = eventfd(0, EFD_NONBLOCK);
+	if (context->broadcast_ring_fd[0] < 0) {
+		fprintf(stderr, "Unable to create broadcast eventfd: %s\n",
+							       strerror(errno));
+		munmap(ring, sizeof(*ring));
+		return 1;
+	}
+	context->broadcast_ring_fd[1] = context->broadcast_ring_fd[0];
+#else
+	if (pipe(context->broadcast_ring_fd)) {
+		fprintf(stderr, "Unable to create broadcast pipe: %s\n",
+							       strerror(errno));
+		munmap(ring, sizeof(*ring));
+		return 1;
+	}
+	for (n = 0; n < 2; n++)
+		lws_set_nonblocking(context->broadcast_ring_fd[n], 1);
+#endif
+
+	context->broadcast_ring = ring;
+
+	return 0;
+}
+
+static void
+lws_destroy_broadcast_ring(struct libwebsocket_context *context)
+{
+	if (!context->broadcast_ring)
+		return;
+
+	/* fds handed over to a dummy wsi are -1 here */
+
+	if (context->broadcast_ring_fd[0] >= 0)
+		close(context->broadcast_ring_fd[0]);
+	if (context->broadcast_ring_fd[1] >= 0 &&
+	       context->broadcast_ring_fd[1] != context->broadcast_ring_fd[0])
+		close(context->broadcast_ring_fd[1]);
+
+	munmap(context->broadcast_ring, sizeof(*context->broadcast_ring));
+	context->broadcast_ring = NULL;
+}
+
+/*
+ * lws_broadcast_ring_post() - queue a broadcast for the service process
+ *
+ * Returns len, or -1 if the payload is too big or the ring is full.
+ */
+
+static int
+lws_broadcast_ring_post(struct libwebsocket_context *context,
+		  int protocol_index, const unsigned char *buf, size_t len)
+{
+	struct lws_broadcast_ring *ring = context->broadcast_ring;
+	struct lws_broadcast_record *rec;
+	unsigned long space = lws_broadcast_record_space(len);
+	unsigned long head;
+	unsigned long pad = 0;
+	unsigned long long one = 1;
+	size_t offset;
+
+	if (len > MAX_BROADCAST_PAYLOAD) {
+		fprintf(stderr, "Broadcast of %d bytes is larger than "
+				"MAX_BROADCAST_PAYLOAD\n", (int)len);
+		return -1;
+	}
+
+	while (__sync_lock_test_and_set(&ring->lock, 1))
+		sched_yield();
+
+	head = ring->head;
+	offset = head & (LWS_BROADCAST_RING_SIZE - 1);
+
+	/* a record never wraps, skip the end of data[] if it won't fit */
+
+	if (LWS_BROADCAST_RING_SIZE - offset < space)
+		pad = LWS_BROADCAST_RING_SIZE - offset;
+
+	if (head + pad + space - ring->tail > LWS_BROADCAST_RING_SIZE) {
+		__sync_lock_release(&ring->lock);
+		debug("broadcast ring full\n");
+		return -1;
+	}
+
+	if (pad) {
+		rec = (struct lws_broadcast_record *)&ring->data[offset];
+		rec->len = LWS_BROADCAST_RING_WRAP;
+		head += pad;
+		offset = 0;
+	}
+
+	rec = (struct lws_broadcast_record *)&ring->data[offset];
+	rec->len = len;
+	rec->protocol_index = protocol_index;
+	memcpy(rec + 1, buf, len);
+
+	/* the record must be complete before the service loop can see it */
+
+	__sync_synchronize();
+	ring->head = head + space;
+
+	__sync_lock_release(&ring->lock);
+
+	if (write(context->broadcast_ring_fd[1], &one, sizeof one) < 0 &&
+							     errno != EAGAIN)
+		fprintf(stderr, "broadcast doorbell: %s\n", strerror(errno));
+
+	return len;
+}
+
+/*
+ * lws_service_broadcast_ring() - deliver everything waiting in the ring
+ */
+
+static void
+lws_service_broadcast_ring(struct libwebsocket_context *context)
+{
+	unsigned char buf[LWS_SEND_BUFFER_PRE_PADDING + MAX_BROADCAST_PAYLOAD +
+						  LWS_SEND_BUFFER_POST_PADDING];
+	struct lws_broadcast_ring *ring = context->broadcast_ring;
+	struct lws_broadcast_record *rec;
+	unsigned long head;
+	unsigned long tail;
+	size_t offset;
+	size_t len;
+	int index;
+
+	/* clear the doorbell before looking, so we can't miss a ring */
+
+	while (read(context->broadcast_ring_fd[0], buf, sizeof buf) > 0)
+		;
+
+	head = ring->head;
+	__sync_synchronize();
+	tail = ring->tail;
+
+	while (tail != head) {
+		offset = tail & (LWS_BROADCAST_RING_SIZE - 1);
+		rec = (struct lws_broadcast_record *)&ring->data[offset];
+
+		if (rec->len == LWS_BROADCAST_RING_WRAP) {
+			tail += LWS_BROADCAST_RING_SIZE - offset;
+			continue;
+		}
+
+		len = rec->len;
+		index = rec->protocol_index;
+		memcpy(buf + LWS_SEND_BUFFER_PRE_PADDING, rec + 1, len);
+		tail += lws_broadcast_record_space(len);
+
+		/* give the space back before calling out to the user */
+
+		__sync_synchronize();
+		ring->tail = tail;
+
+		if (index >= 0 && index < context->count_protocols)
+			lws_broadcast_to_members(context,
+				&context->protocols[index],
+				       buf + LWS_SEND_BUFFER_PRE_PADDING, len);
+	}
+}
+
+#endif
+
+#ifdef LWS_OPENSSL_SUPPORT
+/*
+ * lws_server_ssl_accept() - take a server SSL handshake as far as the
+ *			     socket allows without blocking
+ *
+ * Returns nonzero if the handshake failed and the connection was closed.
+ */
+
+static int
+lws_server_ssl_accept(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi)
+{
+	char ssl_err_buf[512];
+	int n;
+
+	n = SSL_accept(wsi->ssl);
+	if (n == 1) {
+		/*
+		 * from here on the connection is serviced as usual; the
+		 * socket stays nonblocking, SSL_read() and SSL_write() report
+		 * SSL_ERROR_WANT_READ / WANT_WRITE instead of stalling us
+		 */
+
+		lws_change_pollfd(context, wsi, POLLOUT, POLLIN);
+		libwebsocket_set_timeout(context, wsi, NO_PENDING_TIMEOUT, 0);
+		wsi->mode = LWS_CONNMODE_WS_SERVING;
+
+		debug("SSL handshake done on fd=%d SSL ver %s\n",
+				     wsi->sock, SSL_get_version(wsi->ssl));
+		return 0;
+	}
+
+	n = SSL_get_error(wsi->ssl, n);
+	switch (n) {
+	case SSL_ERROR_WANT_READ:
+		lws_change_pollfd(context, wsi, POLLOUT, POLLIN);
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		lws_change_pollfd(context, wsi, 0, POLLOUT);
+		return 0;
+	}
+
+	/*
+	 * browsers seem to probe with various
+	 * ssl params which fail then retry
+	 * and succeed
+	 */
+
+	debug("SSL_accept failed skt %u: %s\n", wsi->sock,
+					    ERR_error_string(n, ssl_err_buf));
+	libwebsocket_close_and_free_session(context, wsi,
+						     LWS_CLOSE_STATUS_NOSTATUS);
+
+	return 1;
+}
+#endif
+
+/*
+ * lws_server_accept() - accept one connection waiting on a listen socket
+ *
+ * Returns 0 if a connection was taken off the backlog, whether or not we
+ * kept it, or 1 if there was nothing more to accept.
+ */
+
+static int
+lws_server_accept(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi)
+{
+	struct libwebsocket *new_wsi;
+	struct sockaddr_in cli_addr;
+	unsigned int clilen;
+	int accept_fd;
+	int opt;
+
+	/* listen socket got an unencrypted connection... */
+
+	clilen = sizeof(cli_addr);
+#if defined(__linux__) && defined(SOCK_CLOEXEC)
+	accept_fd = accept4(wsi->sock, (struct sockaddr *)&cli_addr, &clilen,
+						   SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	accept_fd = accept(wsi->sock, (struct sockaddr *)&cli_addr, &clilen);
+	if (accept_fd >= 0) {
+		lws_set_nonblocking(accept_fd, 1);
+#ifndef WIN32
+		fcntl(accept_fd, F_SETFD, FD_CLOEXEC);
+#endif
+	}
+#endif
+	if (accept_fd < 0) {
+		/* usually the backlog is empty, else try again next time */
+		if (LWS_ERRNO != LWS_EAGAIN && LWS_ERRNO != LWS_EINTR)
+			debug("ERROR on accept: %d\n", LWS_ERRNO);
+		return 1;
+	}
+
+	/*
+	 * take it off the backlog even if we are full, otherwise
+	 * the listen socket just stays readable
+	 */
+
+	if (context->fds_count >= context->max_connections) {
+		fprintf(stderr, "too busy to accept new client\n");
+#ifdef WIN32
+		closesocket(accept_fd);
+#else
+		close(accept_fd);
+#endif
+		return 0;
+	}
+
+	/* Disable Nagle */
+	opt = 1;
+	setsockopt(accept_fd, IPPROTO_TCP, TCP_NODELAY,
+				      (const void *)&opt, sizeof(opt));
+
+	/*
+	 * look at who we connected to and give user code a chance
+	 * to reject based on client IP.  There's no protocol selected
+	 * yet so we issue this to protocols[0]
+	 */
+
+	if ((context->protocols[0].callback)(context, wsi,
+			LWS_CALLBACK_FILTER_NETWORK_CONNECTION,
+				   (void *)(long)accept_fd, NULL, 0)) {
+		debug("Callback denied network connection\n");
+#ifdef WIN32
+		closesocket(accept_fd);
+#else
+		close(accept_fd);
+#endif
+		return 0;
+	}
+
+	/* accepting connection to main listener */
+
+	new_wsi = libwebsocket_create_new_server_wsi(context);
+	if (new_wsi == NULL)
+		return 0;
+
+	new_wsi->sock = accept_fd;
+
+
+#ifdef LWS_OPENSSL_SUPPORT
+	new_wsi->ssl = NULL;
+
+	if (context->use_ssl) {
+
+		new_wsi->ssl = SSL_new(context->ssl_ctx);
+		if (new_wsi->ssl == NULL) {
+			fprintf(stderr, "SSL_new failed: %s\n",
+			    ERR_error_string(SSL_get_error(
+			    new_wsi->ssl, 0), NULL));
+			    libwebsockets_decode_ssl_error();
+			free(new_wsi);
+			return 0;
+		}
+
+		SSL_set_fd(new_wsi->ssl, accept_fd);
+
+		/*
+		 * the handshake is moved on by the service loop as the socket
+		 * allows, so a slow client can't hold everyone else up
+		 */
+
+		new_wsi->mode = LWS_CONNMODE_SSL_ACK_PENDING;
+
+		debug("accepted new SSL conn  port %u on fd=%d\n",
+				  ntohs(cli_addr.sin_port), accept_fd);
+
+	} else
+#endif
+		debug("accepted new conn  port %u on fd=%d\n",
+				  ntohs(cli_addr.sin_port), accept_fd);
+
+	if (insert_wsi_socket_into_fds(context, new_wsi)) {
+#ifdef LWS_OPENSSL_SUPPORT
+		if (new_wsi->ssl)
+			SSL_free(new_wsi->ssl);
+#endif
+#ifdef WIN32
+		closesocket(accept_fd);
+#else
+		close(accept_fd);
+#endif
+		free(new_wsi);
+		return 0;
+	}
+
+#ifdef LWS_OPENSSL_SUPPORT
+	if (new_wsi->mode == LWS_CONNMODE_SSL_ACK_PENDING) {
+		libwebsocket_set_timeout(context, new_wsi,
+					      PENDING_TIMEOUT_SSL_ACCEPT, 5);
+
+		/* the ClientHello is often here already */
+
+		lws_server_ssl_accept(context, new_wsi);
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ * One read on an established connection, passed through the extensions to
+ * the parser.  Returns 1 if wsi got closed, 0 if it's worth reading again
+ * straight away and -1 if the socket is drained for now.
+ */
+
+static int
+lws_service_rx(struct libwebsocket_context *context,
+			 struct libwebsocket *wsi, int flags, int *budget)
+{
+	struct lws_tokens eff_buf;
+	int more_rx;
+	int want;
+	int more;
+	int n;
+	int m;
+
+	if (wsi->read_size < LWS_READ_SIZE_MIN)
+		wsi->read_size = LWS_READ_SIZE_MIN;
+	want = wsi->read_size;
+
+	if (context->rx_buf_size < want) {
+		if (context->rx_buf)
+			free(context->rx_buf);
+		context->rx_buf_size = 0;
+		context->rx_buf = malloc(want);
+		if (!context->rx_buf) {
+			fprintf(stderr, "Out of memory for read buffer\n");
+			libwebsocket_close_and_free_session(context, wsi,
+						    LWS_CLOSE_STATUS_NOSTATUS);
+			return 1;
+		}
+		context->rx_buf_size = want;
+	}
+
+#ifdef LWS_OPENSSL_SUPPORT
+	if (wsi->ssl) {
+		eff_buf.token_len = SSL_read(wsi->ssl, context->rx_buf, want);
+		if (eff_buf.token_len < 0)
+			switch (SSL_get_error(wsi->ssl, eff_buf.token_len)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				/* no whole record yet, wait for the rest */
+				return -1;
+			}
+	} else
+#endif
+		eff_buf.token_len = recv(wsi->sock, context->rx_buf, want,
+									flags);
+
+	if (eff_buf.token_len < 0) {
+		/*
+		 * accepted sockets are nonblocking, so even the first read
+		 * can just find the socket drained
+		 */
+		if (LWS_ERRNO == LWS_EAGAIN || LWS_ERRNO == LWS_EINTR)
+			return -1;
+		fprintf(stderr, "Socket read returned %d\n",
+							    eff_buf.token_len);
+		libwebsocket_close_and_free_session(context, wsi,
+						    LWS_CLOSE_STATUS_NOSTATUS);
+		return 1;
+	}
+	if (!eff_buf.token_len) {
+		libwebsocket_close_and_free_session(context, wsi,
+						    LWS_CLOSE_STATUS_NOSTATUS);
+		return 1;
+	}
+
+	/* grow the reads while they come back full, shrink them if not */
+
+	if (eff_buf.token_len == want) {
+		if (want < LWS_READ_SIZE_MAX)
+			wsi->read_size = want * 2;
+	} else
+		if (eff_buf.token_len < want / 4)
+			wsi->read_size = want / 2;
+
+	*budget -= eff_buf.token_len;
+
+	/*
+	 * a full read means there's probably more waiting; without
+	 * MSG_DONTWAIT we can't look without risking blocking.  SSL can only
+	 * safely go on with what it already decrypted.
+	 */
+
+	more_rx = eff_buf.token_len == want && MSG_DONTWAIT != 0;
+#ifdef LWS_OPENSSL_SUPPORT
+	if (wsi->ssl)
+		more_rx = SSL_pending(wsi->ssl) > 0;
+#endif
+
+	/*
+	 * give any active extensions a chance to munge the buffer
+	 * before parse.  We pass in a pointer to an lws_tokens struct
+	 * prepared with the default buffer and content length that's in
+	 * there.  Rather than rewrite the default buffer, extensions
+	 * that expect to grow the buffer can adapt .token to
+	 * point to their own per-connection buffer in the extension
+	 * user allocation.  By default with no extensions or no
+	 * extension callback handling, just the normal input buffer is
+	 * used then so it is efficient.
+	 */
+
+	eff_buf.token = (char *)context->rx_buf;
+
+	more = 1;
+	while (more) {
+
+		more = 0;
+
+		for (n = 0; n < wsi->count_active_extensions; n++) {
+			m = wsi->active_extensions[n]->callback(context,
+				wsi->active_extensions[n], wsi,
+				LWS_EXT_CALLBACK_PACKET_RX_PREPARSE,
+				wsi->active_extensions_user[n],
+							   &eff_buf, 0);
+			if (m < 0) {
+				fprintf(stderr,
+				    "Extension reports fatal error\n");
+				libwebsocket_close_and_free_session(
+					context, wsi,
+					    LWS_CLOSE_STATUS_NOSTATUS);
+				return 1;
+			}
+			if (m)
+				more = 1;
+		}
+
+		/* service incoming data */
+
+		if (eff_buf.token_len) {
+			n = libwebsocket_read(context, wsi,
+				(unsigned char *)eff_buf.token,
+						    eff_buf.token_len);
+			if (n < 0)
+				/* we closed wsi */
+				return 1;
+		}
+
+		eff_buf.token = NULL;
+		eff_buf.token_len = 0;
+	}
+
+	return more_rx ? 0 : -1;
+}
+
+/**
+ * libwebsocket_service_fd() - Service polled socket with something waiting
+ * @context:	Websocket context
+ * @pollfd:	The pollfd entry describing the socket fd and which events
+ *		happened.
+ *
+ *	This function closes any active connections and then frees the
+ *	context.  After calling this, any further use of the context is
+ *	undefined.
+ */
+
+int
+libwebsocket_service_fd(struct libwebsocket_context *context,
+							  struct pollfd *pollfd)
+{
+	struct libwebsocket *wsi;
+	int n;
+	int budget;
+	int flags;
+	ssize_t len;
+	struct timeval tv;
+	char pkt[1024];
+	char *p = &pkt[0];
 
-		if (context->fds_count >= MAX_CLIENTS) {
-			fprintf(stderr, "too busy to accept new broadcast "
-							      "proxy client\n");
-#ifdef WIN32
-			closesocket(accept_fd);
-#else
-			close(accept_fd);
+#ifdef LWS_OPENSSL_SUPPORT
+	char ssl_err_buf[512];
 #endif
-			break;
-		}
-
-		/* create a dummy wsi for the connection and add it */
+	/*
+	 * you can call us with pollfd = NULL to just allow the once-per-second
+	 * global timeout checks; if less than a second since the last check
+	 * it returns immediately then.
+	 */
 
-		new_wsi = malloc(sizeof(struct libwebsocket));
-		memset(new_wsi, 0, sizeof(struct libwebsocket));
-		new_wsi->sock = accept_fd;
-		new_wsi->mode = LWS_CONNMODE_BROADCAST_PROXY;
-		new_wsi->state = WSI_STATE_ESTABLISHED;
-		new_wsi->count_active_extensions = 0;
-		/* note which protocol we are proxying */
-		new_wsi->protocol_index_for_broadcast_proxy =
-					wsi->protocol_index_for_broadcast_proxy;
-		insert_wsi(context, new_wsi);
+	gettimeofday(&tv, NULL);
 
-		/* add connected socket to internal poll array */
+	lws_service_timeouts(context, tv.tv_sec);
 
-		context->fds[context->fds_count].revents = 0;
-		context->fds[context->fds_count].events = POLLIN;
-		context->fds[context->fds_count++].fd = accept_fd;
+	/* just here for timeout management? */
 
-		/* external POLL support via protocol 0 */
-		context->protocols[0].callback(context, new_wsi,
-			LWS_CALLBACK_ADD_POLL_FD,
-			(void *)(long)accept_fd, NULL, POLLIN);
+	if (pollfd == NULL)
+		return 0;
 
-		break;
+	/* no, here to service a socket descriptor */
 
-	case LWS_CONNMODE_BROADCAST_PROXY:
+	wsi = wsi_from_fd(context, pollfd->fd);
 
-		/* handle session socket closed */
+	if (wsi == NULL)
+		return 1;
 
-		if (pollfd->revents & (POLLERR | POLLHUP)) {
+	switch (wsi->mode) {
+	case LWS_CONNMODE_SERVER_LISTENER:
 
-			debug("Session Socket %p (fd=%d) dead\n",
-				(void *)wsi, pollfd->fd);
+		/* pollin means a client has connected to us then */
 
-			libwebsocket_close_and_free_session(context, wsi,
-						       LWS_CLOSE_STATUS_NORMAL);
-			return 1;
-		}
+		if (!pollfd->revents & POLLIN)
+			break;
 
 		/*
-		 * either extension code with stuff to spill, or the user code,
-		 * requested a callback when it was OK to write
+		 * the listen socket is nonblocking, take everything waiting
+		 * up to the batch limit so a burst of connects doesn't need
+		 * a trip round poll() per connection
 		 */
 
-		if (pollfd->revents & POLLOUT)
-			if (lws_handle_POLLOUT_event(context, wsi,
-								 pollfd) < 0) {
-				libwebsocket_close_and_free_session(
-					context, wsi, LWS_CLOSE_STATUS_NORMAL);
-				return 1;
-			}
-
-		/* any incoming data ready? */
+		for (n = 0; n < context->accept_batch; n++)
+			if (lws_server_accept(context, wsi))
+				break;
+		break;
 
-		if (!(pollfd->revents & POLLIN))
-			break;
+#ifdef LWS_HAS_TASK_QUEUE
+	case LWS_CONNMODE_TASK_WAKEUP:
+		lws_service_tasks(context);
+		break;
+#endif
 
-		/* get the issued broadcast payload from the socket */
+#ifdef LWS_OPENSSL_SUPPORT
+	case LWS_CONNMODE_SSL_ACK_PENDING:
 
-		len = read(pollfd->fd, buf + LWS_SEND_BUFFER_PRE_PADDING,
-							 MAX_BROADCAST_PAYLOAD);
-		if (len < 0) {
-			fprintf(stderr, "Error reading broadcast payload\n");
-			break;
+		if (pollfd->revents & (POLLERR | POLLHUP)) {
+			libwebsocket_close_and_free_session(context, wsi,
+						     LWS_CLOSE_STATUS_NOSTATUS);
+			return 1;
 		}
 
-		/* broadcast it to all guys with this protocol index */
-
-		for (n = 0; n < FD_HASHTABLE_MODULUS; n++) {
-
-			for (m = 0; m < context->fd_hashtable[n].length; m++) {
-
-				new_wsi = context->fd_hashtable[n].wsi[m];
-
-				/* only to clients we are serving to */
-
-				if (new_wsi->mode != LWS_CONNMODE_WS_SERVING)
-					continue;
-
-				/*
-				 * never broadcast to non-established
-				 * connection
-				 */
-
-				if (new_wsi->state != WSI_STATE_ESTABLISHED)
-					continue;
-
-				/*
-				 * only broadcast to connections using
-				 * the requested protocol
-				 */
-
-				if (new_wsi->protocol->protocol_index !=
-					wsi->protocol_index_for_broadcast_proxy)
-					continue;
-
-				/* broadcast it to this connection */
+		if (lws_server_ssl_accept(context, wsi))
+			return 1;
+		break;
+#endif
 
-				new_wsi->protocol->callback(context, new_wsi,
-					LWS_CALLBACK_BROADCAST,
-					new_wsi->user_space,
-					buf + LWS_SEND_BUFFER_PRE_PADDING, len);
-			}
-		}
+#ifndef LWS_NO_FORK
+	case LWS_CONNMODE_BROADCAST_RING:
+		lws_service_broadcast_ring(context);
 		break;
+#endif
 
 	case LWS_CONNMODE_WS_CLIENT_WAITING_PROXY_REPLY:
 
@@ -1795,7 +2970,8 @@ libwebsocket_service_fd(struct libwebsocket_context *context,
 
 		/* clear his proxy connection timeout */
 
-		libwebsocket_set_timeout(wsi, NO_PENDING_TIMEOUT, 0);
+		libwebsocket_set_timeout(context, wsi,
+							NO_PENDING_TIMEOUT, 0);
 
 		/* fallthru */
 
@@ -1865,7 +3041,7 @@ libwebsocket_service_fd(struct libwebsocket_context *context,
 
 		wsi->parser_state = WSI_TOKEN_NAME_PART;
 		wsi->mode = LWS_CONNMODE_WS_CLIENT_WAITING_SERVER_REPLY;
-		libwebsocket_set_timeout(wsi,
+		libwebsocket_set_timeout(context, wsi,
 				PENDING_TIMEOUT_AWAITING_SERVER_RESPONSE, 5);
 
 		break;
@@ -1896,24 +3072,47 @@ libwebsocket_service_fd(struct libwebsocket_context *context,
 
 		/*
 		 * we have to take some care here to only take from the
-		 * socket bytewise.  The browser may (and has been seen to
-		 * in the case that onopen() performs websocket traffic)
-		 * coalesce both handshake response and websocket traffic
-		 * in one packet, since at that point the connection is
-		 * definitively ready from browser pov.
+		 * socket what belongs to the handshake.  The browser may (and
+		 * has been seen to in the case that onopen() performs
+		 * websocket traffic) coalesce both handshake response and
+		 * websocket traffic in one packet, since at that point the
+		 * connection is definitively ready from browser pov.
+		 *
+		 * So we peek, parse, and then only consume what the parser
+		 * used.
 		 */
 
-		len = 1;
-		while (wsi->parser_state != WSI_PARSING_COMPLETE && len > 0) {
+		do {
 #ifdef LWS_OPENSSL_SUPPORT
 			if (wsi->use_ssl)
-				len = SSL_read(wsi->ssl, &c, 1);
-			 else
+				len = SSL_peek(wsi->ssl, pkt, sizeof(pkt));
+			else
 #endif
-				len = recv(wsi->sock, &c, 1, 0);
+				len = recv(wsi->sock, pkt, sizeof(pkt),
+							MSG_PEEK | MSG_DONTWAIT);
+			if (!len)
+				goto bail3;
+			if (len < 0)
+				break;
 
-			libwebsocket_parse(wsi, c);
-		}
+			n = lws_parse_span(context, wsi,
+						   (unsigned char *)pkt, len);
+			if (n < 0)
+				goto bail3;
+
+#ifdef LWS_OPENSSL_SUPPORT
+			if (wsi->use_ssl)
+				SSL_read(wsi->ssl, pkt, n);
+			else
+#endif
+				recv(wsi->sock, pkt, n, 0);
+
+#ifdef LWS_OPENSSL_SUPPORT
+			/* SSL can only say if more is ready without blocking */
+			if (wsi->use_ssl && !SSL_pending(wsi->ssl))
+				break;
+#endif
+		} while (wsi->parser_state != WSI_PARSING_COMPLETE);
 
 		/*
 		 * hs may also be coming in multiple packets, there is a 5-sec
@@ -1965,6 +3164,31 @@ bail3:
 			return 1;
 		}
 
+		/*
+		 * queued output goes first; the user only hears about
+		 * writeability once it has all gone, and only if he asked
+		 * or an extension still has output to spill
+		 */
+
+		if ((pollfd->revents & POLLOUT) && wsi->tx_head) {
+			if (lws_tx_queue_flush(wsi) < 0) {
+				libwebsocket_close_and_free_session(context,
+					       wsi, LWS_CLOSE_STATUS_NOSTATUS);
+				return 1;
+			}
+			if (wsi->tx_head)
+				pollfd->revents &= ~POLLOUT;
+			else
+				if ((!wsi->writeable_requested &&
+				     !wsi->extension_data_pending) ||
+				       wsi->state != WSI_STATE_ESTABLISHED) {
+					pollfd->events &= ~POLLOUT;
+					lws_change_pollfd(context, wsi,
+								 POLLOUT, 0);
+					pollfd->revents &= ~POLLOUT;
+				}
+		}
+
 		/* the guy requested a callback when it was OK to write */
 
 		if ((pollfd->revents & POLLOUT) &&
@@ -1982,79 +3206,21 @@ bail3:
 		if (!(pollfd->revents & POLLIN))
 			break;
 
-#ifdef LWS_OPENSSL_SUPPORT
-		if (wsi->ssl)
-			eff_buf.token_len = SSL_read(wsi->ssl, buf, sizeof buf);
-		else
-#endif
-			eff_buf.token_len =
-					   recv(pollfd->fd, buf, sizeof buf, 0);
-
-		if (eff_buf.token_len < 0) {
-			fprintf(stderr, "Socket read returned %d\n",
-							    eff_buf.token_len);
-			if (errno != EINTR)
-				libwebsocket_close_and_free_session(context,
-					       wsi, LWS_CLOSE_STATUS_NOSTATUS);
-			return 1;
-		}
-		if (!eff_buf.token_len) {
-			libwebsocket_close_and_free_session(context, wsi,
-						    LWS_CLOSE_STATUS_NOSTATUS);
-			return 1;
-		}
-
 		/*
-		 * give any active extensions a chance to munge the buffer
-		 * before parse.  We pass in a pointer to an lws_tokens struct
-		 * prepared with the default buffer and content length that's in
-		 * there.  Rather than rewrite the default buffer, extensions
-		 * that expect to grow the buffer can adapt .token to
-		 * point to their own per-connection buffer in the extension
-		 * user allocation.  By default with no extensions or no
-		 * extension callback handling, just the normal input buffer is
-		 * used then so it is efficient.
+		 * keep reading while the socket looks like it has more for
+		 * us, rather than going back round poll() for every buffer,
+		 * but only up to a budget so busy connections take turns
 		 */
 
-		eff_buf.token = (char *)buf;
-
-		more = 1;
-		while (more) {
-
-			more = 0;
-
-			for (n = 0; n < wsi->count_active_extensions; n++) {
-				m = wsi->active_extensions[n]->callback(context,
-					wsi->active_extensions[n], wsi,
-					LWS_EXT_CALLBACK_PACKET_RX_PREPARSE,
-					wsi->active_extensions_user[n],
-								   &eff_buf, 0);
-				if (m < 0) {
-					fprintf(stderr,
-					    "Extension reports fatal error\n");
-					libwebsocket_close_and_free_session(
-						context, wsi,
-						    LWS_CLOSE_STATUS_NOSTATUS);
-					return 1;
-				}
-				if (m)
-					more = 1;
-			}
-
-			/* service incoming data */
-
-			if (eff_buf.token_len) {
-				n = libwebsocket_read(context, wsi,
-					(unsigned char *)eff_buf.token,
-							    eff_buf.token_len);
-				if (n < 0)
-					/* we closed wsi */
-					return 1;
-			}
-
-			eff_buf.token = NULL;
-			eff_buf.token_len = 0;
-		}
+		budget = LWS_READ_BUDGET;
+		flags = 0;
+		do {
+			n = lws_service_rx(context, wsi, flags, &budget);
+			if (n > 0)
+				/* we closed wsi */
+				return 1;
+			flags = MSG_DONTWAIT;
+		} while (!n && budget > 0 && !wsi->rx_paused);
 		break;
 	}
 
@@ -2078,19 +3244,50 @@ libwebsocket_context_destroy(struct libwebsocket_context *context)
 	struct libwebsocket *wsi;
 	struct libwebsocket_extension *ext;
 
-	for (n = 0; n < FD_HASHTABLE_MODULUS; n++)
-		for (m = 0; m < context->fd_hashtable[n].length; m++) {
-			wsi = context->fd_hashtable[n].wsi[m];
+	/* the first context of a service group takes the others with it */
+
+	if (context->service_group) {
+		libwebsocket_service_threads_stop(context);
+		for (n = 1; n < context->service_group_count; n++)
+			libwebsocket_context_destroy(
+						   context->service_group[n]);
+		free(context->service_group);
+	}
+
+	/* from the top down, so removals do not disturb what is left to do */
+
+	for (n = context->fds_count - 1; n >= 0; n--) {
+		if (n >= context->fds_count)
+			continue;
+		wsi = wsi_from_fd(context, context->fds[n].fd);
+		if (wsi)
 			libwebsocket_close_and_free_session(context, wsi,
 						    LWS_CLOSE_STATUS_GOINGAWAY);
-		}
+	}
+
+#ifdef LWS_HAS_TASK_QUEUE
+	lws_destroy_task_queue(context);
+#endif
+#ifndef LWS_NO_FORK
+	lws_destroy_broadcast_ring(context);
+#endif
+
+	if (context->lws_lookup)
+		free(context->lws_lookup);
+	if (context->fds)
+		free(context->fds);
+	if (context->rx_buf)
+		free(context->rx_buf);
 
 	/*
 	 * give all extensions a chance to clean up any per-context
-	 * allocations they might have made
+	 * allocations they might have made; only the context that
+	 * constructed them, not its service thread siblings
 	 */
 
-	ext = context->extensions;
+	ext = NULL;
+	if (context->extensions_constructed)
+		ext = context->extensions;
 	m = LWS_EXT_CALLBACK_CLIENT_CONTEXT_DESTRUCT;
 	if (context->listen_port)
 		m = LWS_EXT_CALLBACK_SERVER_CONTEXT_DESTRUCT;
@@ -2101,7 +3298,13 @@ libwebsocket_context_destroy(struct libwebsocket_context *context)
 
 #ifdef WIN32
 #else
-	close(context->fd_random);
+	if (context->fd_random >= 0)
+		close(context->fd_random);
+#endif
+
+#ifdef LWS_HAS_EPOLL
+	if (context->epoll_fd >= 0)
+		close(context->epoll_fd);
 #endif
 
 #ifdef LWS_OPENSSL_SUPPORT
@@ -2111,6 +3314,12 @@ libwebsocket_context_destroy(struct libwebsocket_context *context)
 		SSL_CTX_free(context->ssl_client_ctx);
 #endif
 
+	if (context->protocols_owned)
+		free(context->protocols);
+
+	for (n = 0; n < context->count_user_headers; n++)
+		free(context->user_headers[n].token);
+
 	free(context);
 
 #ifdef WIN32
@@ -2118,6 +3327,53 @@ libwebsocket_context_destroy(struct libwebsocket_context *context)
 #endif
 }
 
+#ifdef LWS_HAS_EPOLL
+/*
+ * epoll flavour of the service loop: only descriptors that are ready come
+ * back from the kernel, each is presented to libwebsocket_service_fd() as
+ * a pollfd so everything above this layer is unchanged.  The epoll set is
+ * level-triggered so the one-read-per-event service model stays correct.
+ */
+
+static int
+lws_service_epoll(struct libwebsocket_context *context, int timeout_ms)
+{
+	struct pollfd pfd;
+	unsigned int ev;
+	int n;
+	int m;
+
+	n = epoll_wait(context->epoll_fd, context->epoll_events,
+					      LWS_EPOLL_MAX_EVENTS, timeout_ms);
+	if (n == 0) /* timeout */
+		return libwebsocket_service_fd(context, NULL);
+
+	if (n < 0)
+		return -1;
+
+	for (m = 0; m < n; m++) {
+		ev = context->epoll_events[m].events;
+
+		pfd.fd = context->epoll_events[m].data.fd;
+		pfd.events = 0;
+		pfd.revents = 0;
+		if (ev & EPOLLIN)
+			pfd.revents |= POLLIN;
+		if (ev & EPOLLOUT)
+			pfd.revents |= POLLOUT;
+		if (ev & EPOLLERR)
+			pfd.revents |= POLLERR;
+		if (ev & EPOLLHUP)
+			pfd.revents |= POLLHUP;
+
+		if (libwebsocket_service_fd(context, &pfd) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+#endif
+
 /**
  * libwebsocket_service() - Service any pending websocket activity
  * @context:	Websocket context
@@ -2151,12 +3407,17 @@ libwebsocket_context_destroy(struct libwebsocket_context *context)
  *	wait around blocking other things in your loop from happening, so you
  *	would call it with a timeout_ms of 0, so it returns immediately if
  *	nothing is pending, or as soon as it services whatever was pending.
+ *
+ *	The wait is cut short when a connection timeout falls due before
+ *	timeout_ms is up, so a large timeout does not delay closing
+ *	connections that have timed out.
  */
 
 
 int
 libwebsocket_service(struct libwebsocket_context *context, int timeout_ms)
 {
+	struct pollfd pfd;
 	int n;
 
 	/* stay dead once we are dead */
@@ -2164,11 +3425,20 @@ libwebsocket_service(struct libwebsocket_context *context, int timeout_ms)
 	if (context == NULL)
 		return 1;
 
+	/* don't sleep past the next connection timeout */
+
+	timeout_ms = lws_timeout_until_due(context, timeout_ms);
+
+#ifdef LWS_HAS_EPOLL
+	if (context->epoll_fd >= 0)
+		return lws_service_epoll(context, timeout_ms);
+#endif
+
 	/* wait for something to need service */
 
 	n = poll(context->fds, context->fds_count, timeout_ms);
 	if (n == 0) /* poll timeout */
-		return 0;
+		return libwebsocket_service_fd(context, NULL);
 
 	if (n < 0) {
 		/*
@@ -2177,14 +3447,135 @@ libwebsocket_service(struct libwebsocket_context *context, int timeout_ms)
 		return -1;
 	}
 
-	/* handle accept on listening socket? */
+	/*
+	 * handle accept on listening socket?
+	 *
+	 * Service from a copy of the entry, since the poll array may be
+	 * reallocated by accepts or connects happening during service.
+	 * If the connection closed, the last entry was moved into its
+	 * slot and still needs looking at.
+	 */
+
+	for (n = 0; n < context->fds_count; n++) {
+		if (!context->fds[n].revents)
+			continue;
+		pfd = context->fds[n];
+		if (libwebsocket_service_fd(context, &pfd) < 0)
+			return -1;
+		if (n < context->fds_count && context->fds[n].fd != pfd.fd)
+			n--;
+	}
+	return 0;
+}
+
+#ifdef LWS_HAS_SERVICE_THREADS
+static void *
+lws_service_thread(void *arg)
+{
+	struct libwebsocket_context *context = arg;
+
+	while (!__sync_fetch_and_add(&context->service_thread_stop, 0))
+		if (libwebsocket_service(context,
+					      LWS_SERVICE_THREAD_WAIT_MS) < 0)
+			break;
+
+	return NULL;
+}
+#endif
+
+/**
+ * libwebsocket_service_threads_start() - service a context from threads
+ * @context:	Websocket context, if it is a service group the first one
+ *
+ *	Starts a thread that calls libwebsocket_service() in a loop for
+ *	@context, and for each of the other contexts in its group if it was
+ *	created with tuning.service_threads > 1.  From then on user callbacks
+ *	for a connection happen on the thread of the context it belongs to,
+ *	and you must not call libwebsocket_service() on these contexts
+ *	yourself until libwebsocket_service_threads_stop() has returned.
+ *
+ *	Returns 0 if all the threads started, else nonzero and none are
+ *	left running.
+ */
+
+int
+libwebsocket_service_threads_start(struct libwebsocket_context *context)
+{
+#ifdef LWS_HAS_SERVICE_THREADS
+	struct libwebsocket_context *member;
+	int count = 1;
+	int n;
+
+	if (context->service_group)
+		count = context->service_group_count;
+
+	for (n = 0; n < count; n++) {
+		member = context;
+		if (context->service_group)
+			member = context->service_group[n];
+		if (member->service_thread_running)
+			continue;
+
+		member->service_thread_stop = 0;
+		if (pthread_create(&member->service_thread, NULL,
+						   lws_service_thread, member)) {
+			fprintf(stderr, "Unable to start service thread %d\n",
+									     n);
+			libwebsocket_service_threads_stop(context);
+			return 1;
+		}
+		member->service_thread_running = 1;
+	}
 
-	for (n = 0; n < context->fds_count; n++)
-		if (context->fds[n].revents)
-			if (libwebsocket_service_fd(context,
-							&context->fds[n]) < 0)
-				return -1;
 	return 0;
+#else
+	fprintf(stderr, "Service threads not supported\n");
+
+	return 1;
+#endif
+}
+
+/**
+ * libwebsocket_service_threads_stop() - stop threads servicing a context
+ * @context:	Websocket context given to libwebsocket_service_threads_start()
+ *
+ *	Asks the service threads for @context and its group to finish and
+ *	waits until they have.  Connections stay open, you can start the
+ *	threads again or destroy the context afterwards.
+ */
+
+void
+libwebsocket_service_threads_stop(struct libwebsocket_context *context)
+{
+#ifdef LWS_HAS_SERVICE_THREADS
+	struct libwebsocket_context *member;
+	int count = 1;
+	int n;
+
+	if (context->service_group)
+		count = context->service_group_count;
+
+	for (n = 0; n < count; n++) {
+		member = context;
+		if (context->service_group)
+			member = context->service_group[n];
+		__sync_lock_test_and_set(&member->service_thread_stop, 1);
+#ifdef LWS_HAS_TASK_QUEUE
+		/* don't wait for the poll timeout */
+		lws_task_wakeup(member);
+#endif
+	}
+
+	for (n = 0; n < count; n++) {
+		member = context;
+		if (context->service_group)
+			member = context->service_group[n];
+		if (!member->service_thread_running)
+			continue;
+		pthread_join(member->service_thread, NULL);
+		member->service_thread_running = 0;
+	}
+#endif
 }
 
 int
@@ -2262,21 +3653,12 @@ libwebsocket_callback_on_writable(struct libwebsocket_context *context,
 	if (handled)
 		return 1;
 
-	for (n = 0; n < context->fds_count; n++)
-		if (context->fds[n].fd == wsi->sock) {
-			context->fds[n].events |= POLLOUT;
-			n = context->fds_count + 1;
-		}
+	wsi->writeable_requested = 1;
 
-	if (n == context->fds_count)
+	if (lws_change_pollfd(context, wsi, 0, POLLOUT))
 		fprintf(stderr, "libwebsocket_callback_on_writable: "
 				      "failed to find socket %d\n", wsi->sock);
 
-	/* external POLL support via protocol 0 */
-	context->protocols[0].callback(context, wsi,
-		LWS_CALLBACK_SET_MODE_POLL_FD,
-		(void *)(long)wsi->sock, NULL, POLLOUT);
-
 	return 1;
 }
 
@@ -2294,20 +3676,10 @@ libwebsocket_callback_on_writable_all_protocol(
 				  const struct libwebsocket_protocols *protocol)
 {
 	struct libwebsocket_context *context = protocol->owning_server;
-	int n;
-	int m;
 	struct libwebsocket *wsi;
 
-	for (n = 0; n < FD_HASHTABLE_MODULUS; n++) {
-
-		for (m = 0; m < context->fd_hashtable[n].length; m++) {
-
-			wsi = context->fd_hashtable[n].wsi[m];
-
-			if (wsi->protocol == protocol)
-				libwebsocket_callback_on_writable(context, wsi);
-		}
-	}
+	for (wsi = protocol->established_list; wsi; wsi = wsi->protocol_next)
+		libwebsocket_callback_on_writable(context, wsi);
 
 	return 0;
 }
@@ -2317,36 +3689,70 @@ libwebsocket_callback_on_writable_all_protocol(
  *
  * You will not need this unless you are doing something special
  *
+ * @context:	Websocket context
  * @wsi:	Websocket connection instance
- * @reason:	timeout reason
+ * @reason:	timeout reason, NO_PENDING_TIMEOUT cancels any timeout
  * @secs:	how many seconds
  */
 
 void
-libwebsocket_set_timeout(struct libwebsocket *wsi,
-					  enum pending_timeout reason, int secs)
+libwebsocket_set_timeout(struct libwebsocket_context *context,
+		struct libwebsocket *wsi, enum pending_timeout reason, int secs)
 {
+	struct lws_timer_wheel *tw = &context->timer_wheel;
 	struct timeval tv;
 
+	lws_timer_unlink(tw, wsi);
+
+	wsi->pending_timeout = reason;
+	if (reason == NO_PENDING_TIMEOUT)
+		return;
+
 	gettimeofday(&tv, NULL);
 
 	wsi->pending_timeout_limit = tv.tv_sec + secs;
-	wsi->pending_timeout = reason;
+
+	/* it is killed on the first tick after the limit */
+
+	if (wsi->pending_timeout_limit < tw->now)
+		wsi->pending_timeout_limit = tw->now;
+	lws_timer_link(tw, wsi, wsi->pending_timeout_limit + 1);
 }
 
 
 /**
- * libwebsocket_get_socket_fd() - returns the socket file descriptor
- *
- * You will not need this unless you are doing something special
+ * libwebsocket_get_socket_fd() - returns the socket file descriptor
+ *
+ * You will not need this unless you are doing something special
+ *
+ * @wsi:	Websocket connection instance
+ */
+
+int
+libwebsocket_get_socket_fd(struct libwebsocket *wsi)
+{
+	return wsi->sock;
+}
+
+/**
+ * libwebsocket_get_connection_id() - returns an id for the connection that
+ *				      other threads can post tasks to
  *
  * @wsi:	Websocket connection instance
+ *
+ *	Call this from the service thread, eg, in the
+ *	LWS_CALLBACK_ESTABLISHED callback, and hand the id to other threads
+ *	for libwebsocket_post_write() and
+ *	libwebsocket_post_callback_on_writable().  Unlike the wsi pointer it
+ *	stays safe to use after the connection closes, later connections on
+ *	the same context get different ids (until 2^32 of them have come
+ *	and gone on the same fd).
  */
 
-int
-libwebsocket_get_socket_fd(struct libwebsocket *wsi)
+unsigned long long
+libwebsocket_get_connection_id(struct libwebsocket *wsi)
 {
-	return wsi->sock;
+	return wsi->connection_id;
 }
 
 /**
@@ -2364,34 +3770,13 @@ int
 libwebsocket_rx_flow_control(struct libwebsocket *wsi, int enable)
 {
 	struct libwebsocket_context *context = wsi->protocol->owning_server;
-	int n;
 
-	for (n = 0; n < context->fds_count; n++)
-		if (context->fds[n].fd == wsi->sock) {
-			if (enable)
-				context->fds[n].events |= POLLIN;
-			else
-				context->fds[n].events &= ~POLLIN;
-
-			return 0;
-		}
+	wsi->rx_paused = !enable;
 
 	if (enable)
-		/* external POLL support via protocol 0 */
-		context->protocols[0].callback(context, wsi,
-			LWS_CALLBACK_SET_MODE_POLL_FD,
-			(void *)(long)wsi->sock, NULL, POLLIN);
-	else
-		/* external POLL support via protocol 0 */
-		context->protocols[0].callback(context, wsi,
-			LWS_CALLBACK_CLEAR_MODE_POLL_FD,
-			(void *)(long)wsi->sock, NULL, POLLIN);
+		return lws_change_pollfd(context, wsi, 0, POLLIN);
 
-#if 0
-	fprintf(stderr, "libwebsocket_rx_flow_control "
-						     "unable to find socket\n");
-#endif
-	return 1;
+	return lws_change_pollfd(context, wsi, POLLIN, 0);
 }
 
 /**
@@ -2470,7 +3855,9 @@ OpenSSL_verify_callback(int preverify_ok, X509_STORE_CTX *x509_ctx)
  *			else ignored
  * @gid:	group id to change to after setting listen socket, or -1.
  * @uid:	user id to change to after setting listen socket, or -1.
- * @options:	0, or LWS_SERVER_OPTION_DEFEAT_CLIENT_MASK
+ * @options:	0, or LWS_SERVER_OPTION_DEFEAT_CLIENT_MASK,
+ *		LWS_SERVER_OPTION_USE_EPOLL to have libwebsocket_service() wait
+ *		using epoll rather than poll() where it is available
  *
  *	This function creates the listening socket and takes care
  *	of all initialization in one step.
@@ -2505,20 +3892,39 @@ libwebsocket_create_context(int port, const char *interf,
 			       const char *ssl_cert_filepath,
 			       const char *ssl_private_key_filepath,
 			       int gid, int uid, unsigned int options)
+{
+	return libwebsocket_create_context_extended(port, interf, protocols,
+			extensions, ssl_cert_filepath, ssl_private_key_filepath,
+						       gid, uid, options, NULL);
+}
+
+/*
+ * lws_create_service_context() - one context and its listen socket, the
+ *				   body of libwebsocket_create_context_extended()
+ *				   which calls it once per service thread
+ */
+
+static struct libwebsocket_context *
+lws_create_service_context(int port, const char *interf,
+			       struct libwebsocket_protocols *protocols,
+			       struct libwebsocket_extension *extensions,
+			       const char *ssl_cert_filepath,
+			       const char *ssl_private_key_filepath,
+			       unsigned int options,
+			       const struct libwebsocket_context_tuning *tuning,
+			       int reuse_port)
 {
 	int n;
-	int m;
 	int sockfd = 0;
-	int fd;
-	struct sockaddr_in serv_addr, cli_addr;
+	struct sockaddr_in serv_addr;
 	int opt = 1;
 	struct libwebsocket_context *context = NULL;
-	unsigned int slen;
 	char *p;
 	char hostname[1024] = "";
 //	struct hostent *he;
 	struct libwebsocket *wsi;
 	struct sockaddr sa;
+	struct timeval tv;
 
 #ifdef LWS_OPENSSL_SUPPORT
 	SSL_METHOD *method;
@@ -2554,6 +3960,8 @@ libwebsocket_create_context(int port, const char *interf,
 	}
 #endif
 
+	/* pick the fastest masking and validation kernels this cpu can run */
+	lws_select_kernels();
 
 	context = malloc(sizeof(struct libwebsocket_context));
 	if (!context) {
@@ -2561,22 +3969,52 @@ libwebsocket_create_context(int port, const char *interf,
 		return NULL;
 	}
 	context->protocols = protocols;
+	context->protocols_owned = 0;
+	context->extensions_constructed = 0;
+	context->service_group = NULL;
+	context->service_group_count = 0;
+#ifndef LWS_NO_FORK
+	context->broadcast_ring = NULL;
+#endif
+#ifdef LWS_HAS_SERVICE_THREADS
+	context->service_thread_running = 0;
+	context->service_thread_stop = 0;
+#endif
 	context->listen_port = port;
 	context->http_proxy_port = 0;
 	context->http_proxy_address[0] = '\0';
 	context->options = options;
+	context->count_user_headers = 0;
+	memset(context->user_header_hash, 0, sizeof(context->user_header_hash));
 	context->fds_count = 0;
+	context->connection_serial = 0;
+	context->rx_buf = NULL;
+	context->rx_buf_size = 0;
 	context->extensions = extensions;
 	context->last_timeout_check_s = 0;
+	memset(&context->timer_wheel, 0, sizeof(context->timer_wheel));
+	gettimeofday(&tv, NULL);
+	context->timer_wheel.now = tv.tv_sec;
+	context->ext_1hz_list = NULL;
+	context->rx_buffer_list = NULL;
 
 #ifdef WIN32
 	context->fd_random = 0;
 #else
-	context->fd_random = open(SYSTEM_RANDOM_FILEPATH, O_RDONLY);
-	if (context->fd_random < 0) {
-		fprintf(stderr, "Unable to open random device %s %d\n",
+	/* the pool starts empty and is filled on first use */
+	context->random_pool_pos = LWS_RANDOM_POOL_SIZE;
+	context->fd_random = -1;
+#ifdef LWS_HAS_GETRANDOM
+	/* a zero length getrandom() fails only if the kernel lacks it */
+	if (syscall(SYS_getrandom, context->random_pool, 0, 0) < 0)
+#endif
+	{
+		context->fd_random = open(SYSTEM_RANDOM_FILEPATH, O_RDONLY);
+		if (context->fd_random < 0) {
+			fprintf(stderr, "Unable to open random device %s %d\n",
 				    SYSTEM_RANDOM_FILEPATH, context->fd_random);
-		return NULL;
+			return NULL;
+		}
 	}
 #endif
 
@@ -2697,6 +4135,11 @@ libwebsocket_create_context(int port, const char *interf,
 		return NULL;
 	}
 
+	/* the tx queue retries SSL_write from its own copy of the data */
+
+	SSL_CTX_set_mode(context->ssl_ctx,
+				       SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
 	/* client context */
 
 	if (port == CONTEXT_PORT_NO_LISTEN) {
@@ -2713,6 +4156,8 @@ libwebsocket_create_context(int port, const char *interf,
 				ERR_error_string(ERR_get_error(), ssl_err_buf));
 			return NULL;
 		}
+		SSL_CTX_set_mode(context->ssl_client_ctx,
+				       SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
 		/* openssl init for cert verification (for client sockets) */
 
@@ -2791,10 +4236,56 @@ libwebsocket_create_context(int port, const char *interf,
 	if (lws_b64_selftest())
 		return NULL;
 
-	/* fd hashtable init */
+	/* fd lookup table and poll array grow on demand */
+
+	context->lws_lookup = NULL;
+	context->lws_lookup_len = 0;
+	context->fds = NULL;
+	context->fds_alloc = 0;
+
+	/* by default, as many connections as we can have descriptors */
+
+	context->max_connections = 0;
+	if (tuning)
+		context->max_connections = tuning->max_connections;
+	if (context->max_connections <= 0) {
+#ifdef WIN32
+		context->max_connections = FD_SETSIZE;
+#else
+		context->max_connections = sysconf(_SC_OPEN_MAX);
+		if (context->max_connections <= 0)
+			context->max_connections = 1024;
+#endif
+	}
+	debug("  max connections: %d\n", context->max_connections);
+
+	context->accept_batch = LWS_DEFAULT_ACCEPT_BATCH;
+	if (tuning && tuning->accept_batch > 0)
+		context->accept_batch = tuning->accept_batch;
+
+	/* optional epoll backend for the internal service loop */
+
+#ifdef LWS_HAS_EPOLL
+	context->epoll_fd = -1;
+	if (options & LWS_SERVER_OPTION_USE_EPOLL) {
+		context->epoll_fd = epoll_create(LWS_EPOLL_MAX_EVENTS);
+		if (context->epoll_fd < 0) {
+			fprintf(stderr, "Unable to create epoll fd: %s\n",
+							       strerror(errno));
+			return NULL;
+		}
+		fcntl(context->epoll_fd, F_SETFD, FD_CLOEXEC);
+		fprintf(stderr, " Using epoll service backend\n");
+	}
+#else
+	if (options & LWS_SERVER_OPTION_USE_EPOLL)
+		fprintf(stderr, " epoll not available, using poll()\n");
+#endif
 
-	for (n = 0; n < FD_HASHTABLE_MODULUS; n++)
-		context->fd_hashtable[n].length = 0;
+#ifdef LWS_HAS_TASK_QUEUE
+	if (lws_init_task_queue(context))
+		return NULL;
+#endif
 
 	/* set up our external listening socket we serve on */
 
@@ -2810,6 +4301,16 @@ libwebsocket_create_context(int port, const char *interf,
 		setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
 					      (const void *)&opt, sizeof(opt));
 
+#ifdef LWS_HAS_SERVICE_THREADS
+		/* service threads each bind their own socket to the port */
+		if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+					   (const void *)&opt, sizeof(opt))) {
+			fprintf(stderr, "SO_REUSEPORT failed: %s\n",
+							       strerror(errno));
+			return NULL;
+		}
+#endif
+
 		/* Disable Nagle */
 		opt = 1;
 		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY,
@@ -2834,42 +4335,26 @@ libwebsocket_create_context(int port, const char *interf,
 
 		wsi = malloc(sizeof(struct libwebsocket));
 		memset(wsi, 0, sizeof(struct libwebsocket));
+		wsi->position_in_fds_table = -1;
 		wsi->sock = sockfd;
 		wsi->count_active_extensions = 0;
 		wsi->mode = LWS_CONNMODE_SERVER_LISTENER;
-		insert_wsi(context, wsi);
 
-		listen(sockfd, 5);
+		/* we drain it until there is nothing left to accept */
+		lws_set_nonblocking(sockfd, 1);
+
+		n = SOMAXCONN;
+		if (tuning && tuning->listen_backlog > 0)
+			n = tuning->listen_backlog;
+		listen(sockfd, n);
 		fprintf(stderr, " Listening on port %d\n", port);
 
 		/* list in the internal poll array */
 
-		context->fds[context->fds_count].fd = sockfd;
-		context->fds[context->fds_count++].events = POLLIN;
-
-		/* external POLL support via protocol 0 */
-		context->protocols[0].callback(context, wsi,
-			LWS_CALLBACK_ADD_POLL_FD,
-			(void *)(long)sockfd, NULL, POLLIN);
-
+		insert_wsi_socket_into_fds(context, wsi);
 	}
 
-	/*
-	 * drop any root privs for this process
-	 * to listen on port < 1023 we would have needed root, but now we are
-	 * listening, we don't want the power for anything else
-	 */
-#ifdef WIN32
-#else
-	if (gid != -1)
-		if (setgid(gid))
-			fprintf(stderr, "setgid: %s\n", strerror(errno));
-	if (uid != -1)
-		if (setuid(uid))
-			fprintf(stderr, "setuid: %s\n", strerror(errno));
-#endif
-
-	/* set up our internal broadcast trigger sockets per-protocol */
+	/* fill in the library's part of the protocols */
 
 	for (context->count_protocols = 0;
 			protocols[context->count_protocols].callback;
@@ -2880,85 +4365,156 @@ libwebsocket_create_context(int port, const char *interf,
 		protocols[context->count_protocols].owning_server = context;
 		protocols[context->count_protocols].protocol_index =
 						       context->count_protocols;
+		protocols[context->count_protocols].established_list = NULL;
+		protocols[context->count_protocols].broadcast_socket_port = 0;
+		protocols[context->count_protocols].broadcast_socket_user_fd = 0;
+	}
 
-		fd = socket(AF_INET, SOCK_STREAM, 0);
-		if (fd < 0) {
-			fprintf(stderr, "ERROR opening socket");
-			return NULL;
-		}
+	return context;
+}
 
-		/* allow us to restart even if old sockets in TIME_WAIT */
-		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&opt,
-								  sizeof(opt));
+/**
+ * libwebsocket_create_context_extended() - Create the websocket handler
+ * @port:	Port to listen on, or CONTEXT_PORT_NO_LISTEN
+ * @interf:  NULL to bind the listen socket to all interfaces, or the
+ *		interface name, eg, "eth2"
+ * @protocols:	Array of structures listing supported protocols, as for
+ *		libwebsocket_create_context()
+ * @extensions: NULL or array of libwebsocket_extension structs listing the
+ *		extensions this context supports
+ * @ssl_cert_filepath:	filepath to the server cert if wanting SSL, or NULL
+ * @ssl_private_key_filepath: filepath to private key if wanting SSL mode,
+ *			else ignored
+ * @gid:	group id to change to after setting listen socket, or -1.
+ * @uid:	user id to change to after setting listen socket, or -1.
+ * @options:	0, or bitfield of enum libwebsocket_context_options
+ * @tuning:	NULL for defaults, or a struct libwebsocket_context_tuning
+ *		with the limits you want to change from their defaults.
+ *		Members left as zero keep their default.
+ *
+ *	This is libwebsocket_create_context() with the additional @tuning
+ *	argument; see there for details.
+ *
+ *	If @tuning asks for more than one service thread, the returned
+ *	context is the first of a group of contexts, one per thread, that
+ *	share the listen port.  Each has its own copy of @protocols, so
+ *	libwebsockets_broadcast() and the other calls that take a protocol
+ *	only reach the connections of the context that protocol belongs
+ *	to.  libwebsocket_service_threads_start() runs the group and
+ *	libwebsocket_context_destroy() on the returned context destroys all
+ *	of it.
+ */
 
-		bzero((char *) &serv_addr, sizeof(serv_addr));
-		serv_addr.sin_family = AF_INET;
-		serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-		serv_addr.sin_port = 0; /* pick the port for us */
+struct libwebsocket_context *
+libwebsocket_create_context_extended(int port, const char *interf,
+			       struct libwebsocket_protocols *protocols,
+			       struct libwebsocket_extension *extensions,
+			       const char *ssl_cert_filepath,
+			       const char *ssl_private_key_filepath,
+			       int gid, int uid, unsigned int options,
+			       const struct libwebsocket_context_tuning *tuning)
+{
+	struct libwebsocket_context *context;
+	struct libwebsocket_context *sibling;
+	struct libwebsocket_protocols *copy;
+	struct libwebsocket_extension *ext;
+	int threads = 1;
+	int count;
+	int n;
+	int m;
 
-		n = bind(fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
-		if (n < 0) {
-			fprintf(stderr, "ERROR on binding to port %d (%d %d)\n",
-								port, n, errno);
-			return NULL;
-		}
+	if (port && tuning && tuning->service_threads > 1)
+		threads = tuning->service_threads;
+#ifndef LWS_HAS_SERVICE_THREADS
+	if (threads > 1) {
+		fprintf(stderr, " Service threads not supported, using one\n");
+		threads = 1;
+	}
+#endif
 
-		slen = sizeof cli_addr;
-		n = getsockname(fd, (struct sockaddr *)&cli_addr, &slen);
-		if (n < 0) {
-			fprintf(stderr, "getsockname failed\n");
-			return NULL;
-		}
-		protocols[context->count_protocols].broadcast_socket_port =
-						       ntohs(cli_addr.sin_port);
-		listen(fd, 5);
+	context = lws_create_service_context(port, interf, protocols,
+			extensions, ssl_cert_filepath, ssl_private_key_filepath,
+						  options, tuning, threads > 1);
+	if (context == NULL)
+		return NULL;
+
+	/*
+	 * give all extensions a chance to create any per-context
+	 * allocations they need.  Service thread siblings share the one
+	 * extensions array, so this is only done for the first context
+	 */
 
-		debug("  Protocol %s broadcast socket %d\n",
-				protocols[context->count_protocols].name,
-						      ntohs(cli_addr.sin_port));
+	m = LWS_EXT_CALLBACK_CLIENT_CONTEXT_CONSTRUCT;
+	if (port)
+		m = LWS_EXT_CALLBACK_SERVER_CONTEXT_CONSTRUCT;
 
-		/* dummy wsi per broadcast proxy socket */
+	ext = extensions;
+	while (ext && ext->callback) {
+		debug("  Extension: %s\n", ext->name);
+		ext->callback(context, ext, NULL, m, NULL, NULL, 0);
+		ext++;
+	}
+	context->extensions_constructed = 1;
+
+	if (threads > 1) {
+		context->service_group = malloc(threads *
+				       sizeof(struct libwebsocket_context *));
+		if (context->service_group == NULL) {
+			fprintf(stderr, "Out of memory for service group\n");
+			libwebsocket_context_destroy(context);
+			return NULL;
+		}
+		context->service_group[0] = context;
+		context->service_group_count = 1;
 
-		wsi = malloc(sizeof(struct libwebsocket));
-		memset(wsi, 0, sizeof(struct libwebsocket));
-		wsi->sock = fd;
-		wsi->mode = LWS_CONNMODE_BROADCAST_PROXY_LISTENER;
-		wsi->count_active_extensions = 0;
-		/* note which protocol we are proxying */
-		wsi->protocol_index_for_broadcast_proxy =
-						       context->count_protocols;
-		insert_wsi(context, wsi);
+		for (count = 0; protocols[count].callback; count++)
+			;
 
-		/* list in internal poll array */
+		for (n = 1; n < threads; n++) {
+			/* include the terminator */
+			copy = malloc((count + 1) * sizeof(*copy));
+			if (copy == NULL)
+				break;
+			memcpy(copy, protocols, (count + 1) * sizeof(*copy));
+
+			sibling = lws_create_service_context(port, interf, copy,
+					 extensions, ssl_cert_filepath,
+					 ssl_private_key_filepath, options,
+								   tuning, 1);
+			if (sibling == NULL) {
+				free(copy);
+				break;
+			}
+			sibling->protocols_owned = 1;
+			context->service_group[
+				     context->service_group_count++] = sibling;
+		}
 
-		context->fds[context->fds_count].fd = fd;
-		context->fds[context->fds_count].events = POLLIN;
-		context->fds[context->fds_count].revents = 0;
-		context->fds_count++;
+		if (n != threads) {
+			fprintf(stderr, "Unable to create service thread "
+						    "context %d of %d\n", n, threads);
+			libwebsocket_context_destroy(context);
+			return NULL;
+		}
 
-		/* external POLL support via protocol 0 */
-		context->protocols[0].callback(context, wsi,
-			LWS_CALLBACK_ADD_POLL_FD,
-			(void *)(long)fd, NULL, POLLIN);
+		fprintf(stderr, " %d service threads listening on port %d\n",
+								 threads, port);
 	}
 
 	/*
-	 * give all extensions a chance to create any per-context
-	 * allocations they need
+	 * drop any root privs for this process
+	 * to listen on port < 1023 we would have needed root, but now we are
+	 * listening, we don't want the power for anything else
 	 */
-
-	m = LWS_EXT_CALLBACK_CLIENT_CONTEXT_CONSTRUCT;
-	if (port)
-		m = LWS_EXT_CALLBACK_SERVER_CONTEXT_CONSTRUCT;
-	
-	if (extensions) {
-	    while (extensions->callback) {
-		    debug("  Extension: %s\n", extensions->name);
-		    extensions->callback(context, extensions,
-						NULL, m, NULL, NULL, 0);
-		    extensions++;
-	    }
-	}
+#ifdef WIN32
+#else
+	if (gid != -1)
+		if (setgid(gid))
+			fprintf(stderr, "setgid: %s\n", strerror(errno));
+	if (uid != -1)
+		if (setuid(uid))
+			fprintf(stderr, "setuid: %s\n", strerror(errno));
+#endif
 
 	return context;
 }
@@ -2979,49 +4535,68 @@ libwebsocket_create_context(int port, const char *interf,
 int
 libwebsockets_fork_service_loop(struct libwebsocket_context *context)
 {
-	int fd;
-	struct sockaddr_in cli_addr;
+	struct libwebsocket *wsi;
 	int n;
 	int p;
 
+	if (context->service_group) {
+		fprintf(stderr, "Can't fork a service loop for a context "
+					   "with service threads, use "
+				    "libwebsocket_service_threads_start()\n");
+		return -1;
+	}
+
+	/* broadcasts reach the service process through a shared ring */
+
+	if (lws_init_broadcast_ring(context))
+		return -1;
+
 	n = fork();
-	if (n < 0)
+	if (n < 0) {
+		lws_destroy_broadcast_ring(context);
 		return n;
+	}
+
+	/* neither process may hand out random bytes the other one has */
+
+	context->random_pool_pos = LWS_RANDOM_POOL_SIZE;
 
 	if (!n) {
 
 		/* main process context */
 
 		/*
-		 * set up the proxy sockets to allow broadcast from
-		 * service process context
+		 * libwebsockets_broadcast() on any protocol now goes into the
+		 * ring and rings the doorbell
 		 */
 
-		for (p = 0; p < context->count_protocols; p++) {
-			fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (fd < 0) {
-				fprintf(stderr, "Unable to create socket\n");
-				return -1;
-			}
-			cli_addr.sin_family = AF_INET;
-			cli_addr.sin_port = htons(
-			     context->protocols[p].broadcast_socket_port);
-			cli_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-			n = connect(fd, (struct sockaddr *)&cli_addr,
-							       sizeof cli_addr);
-			if (n < 0) {
-				fprintf(stderr, "Unable to connect to "
-						"broadcast socket %d, %s\n",
-						n, strerror(errno));
-				return -1;
-			}
-
-			context->protocols[p].broadcast_socket_user_fd = fd;
-		}
+		for (p = 0; p < context->count_protocols; p++)
+			context->protocols[p].broadcast_socket_user_fd =
+						  context->broadcast_ring_fd[1];
 
 		return 0;
 	}
 
+	/* the service process listens for the doorbell */
+
+	wsi = malloc(sizeof(struct libwebsocket));
+	if (wsi == NULL) {
+		fprintf(stderr, "Out of memory for broadcast ring\n");
+		return -1;
+	}
+	memset(wsi, 0, sizeof(struct libwebsocket));
+	wsi->position_in_fds_table = -1;
+	wsi->sock = context->broadcast_ring_fd[0];
+	wsi->mode = LWS_CONNMODE_BROADCAST_RING;
+	if (insert_wsi_socket_into_fds(context, wsi))
+		return -1;
+
+	/* the wsi owns the read side now, and we never write an eventfd */
+
+	if (context->broadcast_ring_fd[1] == context->broadcast_ring_fd[0])
+		context->broadcast_ring_fd[1] = -1;
+	context->broadcast_ring_fd[0] = -1;
+
 #ifdef HAVE_SYS_PRCTL_H
 	/* we want a SIGHUP when our parent goes down */
 	prctl(PR_SET_PDEATHSIG, SIGHUP);
@@ -3084,7 +4659,9 @@ libwebsockets_get_protocol(struct libwebsocket *wsi)
  *
  * libwebsockets_broadcast() can be called from another fork context without
  * having to take any care about data visibility between the processes, it'll
- * "just work".
+ * "just work".  From there each call is delivered as one message of up to
+ * MAX_BROADCAST_PAYLOAD bytes; it returns -1 if the payload is bigger or
+ * the service process has fallen so far behind that the shared ring is full.
  */
 
 
@@ -3093,68 +4670,154 @@ libwebsockets_broadcast(const struct libwebsocket_protocols *protocol,
 						 unsigned char *buf, size_t len)
 {
 	struct libwebsocket_context *context = protocol->owning_server;
-	int n;
-	int m;
-	struct libwebsocket *wsi;
 
 	if (!protocol->broadcast_socket_user_fd) {
 		/*
 		 * We are either running unforked / flat, or we are being
 		 * called from poll thread context
-		 * eg, from a callback.  In that case don't use sockets for
-		 * broadcast IPC (since we can't open a socket connection to
-		 * a socket listening on our own thread) but directly do the
-		 * send action.
+		 * eg, from a callback.  In that case there's no need for
+		 * broadcast IPC, just directly do the send action.
 		 *
 		 * Locking is not needed because we are by definition being
 		 * called in the poll thread context and are serialized.
 		 */
 
-		for (n = 0; n < FD_HASHTABLE_MODULUS; n++) {
+		lws_broadcast_to_members(context, protocol, buf, len);
 
-			for (m = 0; m < context->fd_hashtable[n].length; m++) {
+		return 0;
+	}
 
-				wsi = context->fd_hashtable[n].wsi[m];
+	/*
+	 * We're being called from a different process context than the server
+	 * loop.  Instead of broadcasting directly, we put our payload in the
+	 * shared broadcast ring; the server process will serialize the
+	 * broadcast action in its main poll() loop.
+	 */
 
-				if (wsi->mode != LWS_CONNMODE_WS_SERVING)
-					continue;
+#ifndef LWS_NO_FORK
+	return lws_broadcast_ring_post(context, protocol->protocol_index,
+								     buf, len);
+#else
+	return -1;
+#endif
+}
 
-				/*
-				 * never broadcast to
-				 * non-established connections
-				 */
-				if (wsi->state != WSI_STATE_ESTABLISHED)
-					continue;
+/*
+ * lws_broadcast_frame_for() - the shared frame for a connection's framing
+ *
+ * 04..06 and 07+ differ only in their opcodes, so at most two frames are
+ * built for one broadcast, each the first time a member needs it.
+ */
 
-				/* only broadcast to guys using
-				 * requested protocol
-				 */
-				if (wsi->protocol != protocol)
-					continue;
+static struct lws_tx_frame *
+lws_broadcast_frame_for(struct libwebsocket *wsi,
+			struct lws_tx_frame **frames, const unsigned char *buf,
+		      size_t len, enum libwebsocket_write_protocol protocol)
+{
+	int v7 = wsi->ietf_spec_revision >= 7;
+	unsigned char hdr[10];
+	struct lws_tx_frame *frame;
+	int n;
 
-				wsi->protocol->callback(context, wsi,
-					 LWS_CALLBACK_BROADCAST,
-					 wsi->user_space,
-					 buf, len);
-			}
-		}
+	if (frames[v7])
+		return frames[v7];
 
-		return 0;
+	n = lws_frame_header(hdr, wsi->ietf_spec_revision, len, protocol);
+	if (n < 0)
+		return NULL;
+
+	frame = malloc(sizeof(*frame) + n + len);
+	if (frame == NULL) {
+		fprintf(stderr, "Out of memory for broadcast frame\n");
+		return NULL;
 	}
+	frame->refcount = 1; /* ours until the broadcast is done */
+	frame->len = n + len;
+	memcpy(frame + 1, hdr, n);
+	memcpy((unsigned char *)(frame + 1) + n, buf, len);
 
-	/*
-	 * We're being called from a different process context than the server
-	 * loop.  Instead of broadcasting directly, we send our
-	 * payload on a socket to do the IPC; the server process will serialize
-	 * the broadcast action in its main poll() loop.
-	 *
-	 * There's one broadcast socket listening for each protocol supported
-	 * set up when the websocket server initializes
-	 */
+	frames[v7] = frame;
 
-	n = send(protocol->broadcast_socket_user_fd, buf, len, MSG_NOSIGNAL);
+	return frame;
+}
 
-	return n;
+/**
+ * libwebsockets_broadcast_frame() - Send one message to every connection on
+ *				     a protocol, framing it only once
+ * @protocol:	Protocol whose connections get the message
+ * @buf:	The payload.  No padding is needed and it is not modified.
+ * @len:	Length of payload
+ * @write_protocol: LWS_WRITE_TEXT, LWS_WRITE_BINARY or
+ *		LWS_WRITE_CONTINUATION, optionally with LWS_WRITE_NO_FIN
+ *
+ *	Unlike libwebsockets_broadcast(), this doesn't call back into the
+ *	protocol for each connection: the payload is framed once into a
+ *	reference-counted buffer and that same buffer is sent to every
+ *	established connection using @protocol.  What a connection can't
+ *	take right away stays queued by reference on that connection and the
+ *	buffer is freed after the last connection has sent it.
+ *
+ *	Connections that need their own copy of the frame, those using SSL
+ *	or an active extension, get it through libwebsocket_write_iov()
+ *	instead.
+ *
+ *	It must be called from the thread servicing the context, eg, from a
+ *	callback; other threads can get there with
+ *	libwebsocket_post_closure().  It broadcasts only to the connections
+ *	of the context @protocol belongs to.
+ */
+
+int
+libwebsockets_broadcast_frame(const struct libwebsocket_protocols *protocol,
+			   const unsigned char *buf, size_t len,
+			   enum libwebsocket_write_protocol write_protocol)
+{
+	struct lws_tx_frame *frames[2] = { NULL, NULL };
+	struct lws_tx_frame *frame;
+	struct libwebsocket *wsi;
+	struct iovec iov;
+	int n;
+
+	if (protocol->broadcast_socket_user_fd) {
+		fprintf(stderr, "libwebsockets_broadcast_frame: "
+				       "not from outside the service loop\n");
+		return -1;
+	}
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+
+	for (wsi = protocol->established_list; wsi; wsi = wsi->protocol_next) {
+
+		if (wsi->mode != LWS_CONNMODE_WS_SERVING ||
+					    wsi->state != WSI_STATE_ESTABLISHED)
+			continue;
+
+		frame = NULL;
+		if (!wsi->count_active_extensions &&
+#ifdef LWS_OPENSSL_SUPPORT
+						      !wsi->ssl &&
+#endif
+					       wsi->ietf_spec_revision >= 4)
+			frame = lws_broadcast_frame_for(wsi, frames, buf, len,
+								write_protocol);
+
+		/*
+		 * a send error here will be seen when the connection is
+		 * next serviced, closing him now would upset our walk
+		 */
+
+		if (frame)
+			lws_tx_send_frame(wsi, frame);
+		else
+			libwebsocket_write_iov(wsi, &iov, 1, write_protocol);
+	}
+
+	for (n = 0; n < 2; n++)
+		if (frames[n])
+			lws_tx_frame_unref(frames[n]);
+
+	return 0;
 }
 
 int
@@ -53,6 +53,7 @@ typedef int ssize_t;
 
 #else
 #include <poll.h>
+#include <sys/uio.h>
 #endif
 
 #ifndef LWS_EXTERN
@@ -65,6 +66,13 @@ typedef int ssize_t;
 enum libwebsocket_context_options {
 	LWS_SERVER_OPTION_DEFEAT_CLIENT_MASK = 1,
 	LWS_SERVER_OPTION_REQUIRE_VALID_OPENSSL_CLIENT_CERT = 2,
+	LWS_SERVER_OPTION_USE_EPOLL = 4,
+};
+
+enum libwebsocket_protocol_options {
+	LWS_PROTOCOL_OPTION_RX_IN_PLACE = 1,
+	LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE = 2,
+	LWS_PROTOCOL_OPTION_RX_VALIDATE_UTF8 = 4,
 };
 
 enum libwebsocket_callback_reasons {
@@ -187,6 +195,7 @@ enum lws_token_indexes {
 	WSI_TOKEN_SKIPPING_SAW_CR,
 	WSI_PARSING_COMPLETE,
 	WSI_INIT_TOKEN_MUXURL,
+	WSI_TOKEN_USER_HEADER,
 };
 
 /*
@@ -217,6 +226,15 @@ enum lws_token_indexes {
 
       1004 indicates that an endpoint is terminating the connection
       because it has received a message that is too large.
+
+ * From RFC 6455
+
+   1007
+
+      1007 indicates that an endpoint is terminating the connection
+      because it has received data within a message that was not
+      consistent with the type of the message (e.g., non-UTF-8 [RFC3629]
+      data within a text message).
 */
 
 enum lws_close_status {
@@ -226,6 +244,7 @@ enum lws_close_status {
 	LWS_CLOSE_STATUS_PROTOCOL_ERR = 1002,
 	LWS_CLOSE_STATUS_UNACCEPTABLE_OPCODE = 1003,
 	LWS_CLOSE_STATUS_PAYLOAD_TOO_LARGE = 1004,
+	LWS_CLOSE_STATUS_INVALID_PAYLOAD = 1007,
 };
 
 struct libwebsocket;
@@ -268,7 +287,9 @@ struct libwebsocket_extension;
  *
  *	LWS_CALLBACK_RECEIVE: data has appeared for this server endpoint from a
  *				remote client, it can be found at *in and is
- *				len bytes long
+ *				len bytes long.  With LWS_PROTOCOL_OPTION_RX_IN_PLACE
+ *				*in points into the socket read buffer instead,
+ *				and has no padding or NUL terminator
  *
  *	LWS_CALLBACK_CLIENT_RECEIVE_PONG: if you elected to see PONG packets,
  *				they appear with this callback reason.  PONG
@@ -276,7 +297,8 @@ struct libwebsocket_extension;
  *
  *	LWS_CALLBACK_CLIENT_RECEIVE: data has appeared from the server for the
  *				client connection, it can be found at *in and
- *				is len bytes long
+ *				is len bytes long (see LWS_CALLBACK_RECEIVE about
+ *				LWS_PROTOCOL_OPTION_RX_IN_PLACE)
  *
  *	LWS_CALLBACK_HTTP: an http request has come from a client that is not
  *				asking to upgrade the connection to a websocket
@@ -314,7 +336,9 @@ struct libwebsocket_extension;
  *		use the header enums lws_token_indexes from libwebsockets.h
  *		to check for and read the supported header presence and
  *		content before deciding to allow the handshake to proceed or
- *		to kill the connection.
+ *		to kill the connection.  Headers added with
+ *		libwebsocket_register_header() are read with
+ *		libwebsocket_get_header().
  *
  * 	LWS_CALLBACK_OPENSSL_LOAD_EXTRA_CLIENT_VERIFY_CERTS: if configured for
  * 		including OpenSSL support, this callback allows your user code
@@ -519,16 +543,43 @@ typedef int (extension_callback_function)(struct libwebsocket_context * context,
  *		this much memory allocated on connection establishment and
  *		freed on connection takedown.  A pointer to this per-connection
  *		allocation is passed into the callback in the 'user' parameter
+ * @options:	0, or LWS_PROTOCOL_OPTION_RX_IN_PLACE to have v7+ text and
+ *		binary payload unmasked inside the socket read buffer and
+ *		handed to the callback from there, as much of the frame as
+ *		each read brought in, rather than copied through the
+ *		per-connection rx buffer.  The callback must copy anything it
+ *		wants to keep or send back out with libwebsocket_write(), and
+ *		can use libwebsockets_remaining_packet_payload() to see how
+ *		much of the frame is still to come.
+ *		LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE delivers each message in
+ *		one callback, see @rx_max_message_size.
+ *		LWS_PROTOCOL_OPTION_RX_VALIDATE_UTF8 checks text messages are
+ *		valid UTF-8 before the callback sees them, even when a
+ *		character is split between callbacks, and closes the
+ *		connection with LWS_CLOSE_STATUS_INVALID_PAYLOAD if not
+ * @rx_buffer_size: 0 for the default of 4096, or how many bytes of payload
+ *		the library may gather for each receive callback.  The buffer
+ *		is allocated when first needed and freed again after the
+ *		connection has received nothing for a few seconds
+ * @rx_max_message_size: with LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE in
+ *		@options, each message is gathered across its continuation
+ *		frames and given to the callback in one piece, with the usual
+ *		padding around it.  This is the largest message accepted, 0
+ *		means 1MB; anything bigger closes the connection with
+ *		LWS_CLOSE_STATUS_PAYLOAD_TOO_LARGE.  The whole message option
+ *		takes precedence over LWS_PROTOCOL_OPTION_RX_IN_PLACE
  * @owning_server:	the server init call fills in this opaque pointer when
  *		registering this protocol with the server.
- * @broadcast_socket_port: the server init call fills this in with the
- *		localhost port number used to forward broadcasts for this
- *		protocol
- * @broadcast_socket_user_fd:  the server init call fills this in ... the main()
- *		process context can write to this socket to perform broadcasts
- *		(use the libwebsockets_broadcast() api to do this instead,
- *		it works from any process context)
+ * @broadcast_socket_port: no longer used, broadcasts from another process
+ *		go through shared memory; the server init call sets it to 0
+ * @broadcast_socket_user_fd:  libwebsockets_fork_service_loop() fills this in
+ *		in the main() process context with the doorbell it uses to
+ *		tell the service process a broadcast is waiting (use the
+ *		libwebsockets_broadcast() api, it works from any process
+ *		context)
  * @protocol_index: which protocol we are starting from zero
+ * @established_list: the server init call clears this, it's the head of the
+ *		library's list of established connections using this protocol
  *
  *	This structure represents one protocol supported by the server.  An
  *	array of these structures is passed to libwebsocket_create_server()
@@ -539,6 +590,9 @@ struct libwebsocket_protocols {
 	const char *name;
 	callback_function *callback;
 	size_t per_session_data_size;
+	unsigned int options;
+	size_t rx_buffer_size;
+	size_t rx_max_message_size;
 
 	/*
 	 * below are filled in on server init and can be left uninitialized,
@@ -549,6 +603,7 @@ struct libwebsocket_protocols {
 	int broadcast_socket_port;
 	int broadcast_socket_user_fd;
 	int protocol_index;
+	struct libwebsocket *established_list;
 };
 
 /**
@@ -571,6 +626,40 @@ struct libwebsocket_extension {
 	void * per_context_private_data;
 };
 
+/**
+ * struct libwebsocket_context_tuning - Optional limits for a context
+ *
+ * @max_connections:	Most sockets the context will hold open at once;
+ *			further incoming connections are accepted and then
+ *			immediately closed.  0 means the process descriptor
+ *			limit.  The connection tables are sized to what is
+ *			actually in use, not to this number.
+ * @service_threads:	Number of service threads for a listening context,
+ *			0 or 1 for the usual single service loop.  Each
+ *			thread gets its own context with its own copy of the
+ *			protocols array and its own connections, all
+ *			listening on the same port with SO_REUSEPORT so the
+ *			kernel spreads incoming connections across them.
+ *			See libwebsocket_service_threads_start().
+ * @listen_backlog:	Backlog given to listen() for the server socket,
+ *			0 means SOMAXCONN.  Too small a backlog drops
+ *			connection attempts when many clients connect at once.
+ * @accept_batch:	Most new connections accepted each time the listen
+ *			socket is serviced, 0 means 32.  Further ones wait
+ *			for the next time round so existing connections
+ *			still get serviced during a flood of connects.
+ *
+ *	Pass one of these to libwebsocket_create_context_extended().  Zero
+ *	the whole struct first and set only what you want to change, members
+ *	left as zero keep their defaults.
+ */
+
+struct libwebsocket_context_tuning {
+	int max_connections;
+	int service_threads;
+	int listen_backlog;
+	int accept_batch;
+};
 
 
 LWS_EXTERN struct libwebsocket_context *
@@ -581,9 +670,24 @@ libwebsocket_create_context(int port, const char * interf,
 		  const char *ssl_private_key_filepath, int gid, int uid,
 		  unsigned int options);
 
+LWS_EXTERN struct libwebsocket_context *
+libwebsocket_create_context_extended(int port, const char * interf,
+		  struct libwebsocket_protocols *protocols,
+		  struct libwebsocket_extension *extensions,
+		  const char *ssl_cert_filepath,
+		  const char *ssl_private_key_filepath, int gid, int uid,
+		  unsigned int options,
+		  const struct libwebsocket_context_tuning *tuning);
+
 LWS_EXTERN void
 libwebsocket_context_destroy(struct libwebsocket_context *context);
 
+LWS_EXTERN int
+libwebsocket_service_threads_start(struct libwebsocket_context *context);
+
+LWS_EXTERN void
+libwebsocket_service_threads_stop(struct libwebsocket_context *context);
+
 LWS_EXTERN int
 libwebsockets_fork_service_loop(struct libwebsocket_context *context);
 
@@ -632,6 +736,15 @@ LWS_EXTERN int
 libwebsocket_write(struct libwebsocket *wsi, unsigned char *buf, size_t len,
 				     enum libwebsocket_write_protocol protocol);
 
+/*
+ * libwebsocket_write_iov() takes the payload in pieces and needs no padding
+ * around any of them
+ */
+
+LWS_EXTERN int
+libwebsocket_write_iov(struct libwebsocket *wsi, const struct iovec *iov,
+		   int iovcnt, enum libwebsocket_write_protocol protocol);
+
 LWS_EXTERN int
 libwebsockets_serve_http_file(struct libwebsocket *wsi, const char *file,
 						     const char *content_type);
@@ -642,6 +755,11 @@ LWS_EXTERN int
 libwebsockets_broadcast(const struct libwebsocket_protocols *protocol,
 						unsigned char *buf, size_t len);
 
+LWS_EXTERN int
+libwebsockets_broadcast_frame(const struct libwebsocket_protocols *protocol,
+			   const unsigned char *buf, size_t len,
+			   enum libwebsocket_write_protocol write_protocol);
+
 LWS_EXTERN const struct libwebsocket_protocols *
 libwebsockets_get_protocol(struct libwebsocket *wsi);
 
@@ -653,9 +771,28 @@ LWS_EXTERN int
 libwebsocket_callback_on_writable_all_protocol(
 				 const struct libwebsocket_protocols *protocol);
 
+typedef void (libwebsocket_task_function)(
+			struct libwebsocket_context *context, void *arg);
+
+LWS_EXTERN int
+libwebsocket_post_write(struct libwebsocket_context *context,
+		unsigned long long connection_id, const unsigned char *buf,
+			size_t len, enum libwebsocket_write_protocol protocol);
+
+LWS_EXTERN int
+libwebsocket_post_callback_on_writable(struct libwebsocket_context *context,
+					     unsigned long long connection_id);
+
+LWS_EXTERN int
+libwebsocket_post_closure(struct libwebsocket_context *context,
+			     libwebsocket_task_function *closure, void *arg);
+
 LWS_EXTERN int
 libwebsocket_get_socket_fd(struct libwebsocket *wsi);
 
+LWS_EXTERN unsigned long long
+libwebsocket_get_connection_id(struct libwebsocket *wsi);
+
 LWS_EXTERN int
 libwebsocket_is_final_fragment(struct libwebsocket *wsi);
 
@@ -710,6 +847,13 @@ LWS_EXTERN int
 libwebsockets_get_random(struct libwebsocket_context *context,
 							    void *buf, int len);
 
+LWS_EXTERN int
+libwebsocket_register_header(struct libwebsocket_context *context,
+							     const char *name);
+
+LWS_EXTERN const char *
+libwebsocket_get_header(struct libwebsocket *wsi, int index, int *len);
+
 LWS_EXTERN int
 lws_send_pipe_choked(struct libwebsocket *wsi);
 
@@ -21,6 +21,12 @@
 
 #include "private-libwebsockets.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LWS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
 const struct lws_tokens lws_tokens[WSI_TOKEN_COUNT] = {
 
 	/* win32 can't do C99 */
@@ -47,254 +53,1136 @@ const struct lws_tokens lws_tokens[WSI_TOKEN_COUNT] = {
 /*	[WSI_TOKEN_HTTP]	=	*/{ "HTTP/1.1 ",		 9 },
 /*	[WSI_TOKEN_MUXURL]	=	*/{ "",		 -1 },
 
-};
+};
+
+/*
+ * Header names are recognized in one step: the name length and the last
+ * byte before its delimiter, with case folded, hash each of lws_tokens[] to
+ * its own slot here (holding the token index + 1), so at most one strncasecmp
+ * confirms it.  Names registered by the user hash the same way into a table
+ * in the context, which is only searched when this one misses.
+ */
+
+#define LWS_HDR_HASH(name, len) \
+	((((unsigned char)(name)[(len) - 2] | 0x20) * 2 + (len)) & \
+						       (LWS_HDR_HASH_SIZE - 1))
+
+static const unsigned char lws_token_hash[LWS_HDR_HASH_SIZE] = {
+	0, 0, 0, 0, WSI_TOKEN_KEY + 1, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, WSI_TOKEN_UPGRADE + 1, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, WSI_TOKEN_CHALLENGE + 1, 0, WSI_TOKEN_NONCE + 1, 0,
+	0, 0, 0, WSI_TOKEN_ORIGIN + 1, 0, 0, 0, WSI_TOKEN_CONNECTION + 1,
+	0, 0, 0, WSI_TOKEN_HTTP + 1, WSI_TOKEN_GET_URI + 1,
+					   WSI_TOKEN_HOST + 1, 0,
+						      WSI_TOKEN_PROTOCOL + 1,
+	0, WSI_TOKEN_SWORIGIN + 1, WSI_TOKEN_VERSION + 1, 0, 0,
+				   WSI_TOKEN_KEY1 + 1, 0, WSI_TOKEN_KEY2 + 1,
+	0, 0, 0, 0, WSI_TOKEN_DRAFT + 1, WSI_TOKEN_ACCEPT + 1, 0,
+						    WSI_TOKEN_EXTENSIONS + 1,
+};
+
+/* known headers come first, then any the user registered */
+
+static struct lws_tokens *
+lws_hdr_token(struct libwebsocket *wsi, int n)
+{
+	if (n < WSI_TOKEN_COUNT)
+		return &wsi->utf8_token[n];
+
+	return &wsi->user_token[n - WSI_TOKEN_COUNT];
+}
+
+static struct lws_tokens *
+lws_hdr_current(struct libwebsocket *wsi)
+{
+	if (wsi->parser_state == WSI_TOKEN_USER_HEADER)
+		return &wsi->user_token[wsi->user_token_current];
+
+	return &wsi->utf8_token[wsi->parser_state];
+}
+
+/*
+ * Every header value we keep is stored NUL terminated in wsi->hdr_buf, the
+ * one being collected always at the end.  Growing the buffer moves it, so
+ * the token pointers are rebased afterwards.
+ *
+ * Returns 0 if len more bytes fit, 1 if that would go over the limit and
+ * -1 on OOM.
+ */
+
+static int
+lws_hdr_reserve(struct libwebsocket *wsi, int len)
+{
+	int ofs[WSI_TOKEN_COUNT + LWS_MAX_USER_HEADERS];
+	int count = WSI_TOKEN_COUNT;
+	int alloc = wsi->hdr_buf_alloc;
+	struct lws_tokens *t;
+	char *p;
+	int n;
+
+	if (wsi->hdr_buf_len + len <= alloc)
+		return 0;
+	if (wsi->hdr_buf_len + len > LWS_MAX_HEADERS_LEN)
+		return 1;
+
+	if (!alloc)
+		alloc = LWS_INITIAL_HDR_ALLOC;
+	while (alloc < wsi->hdr_buf_len + len)
+		alloc <<= 1;
+	if (alloc > LWS_MAX_HEADERS_LEN)
+		alloc = LWS_MAX_HEADERS_LEN;
+
+	if (wsi->user_token)
+		count += LWS_MAX_USER_HEADERS;
+
+	for (n = 0; n < count; n++) {
+		t = lws_hdr_token(wsi, n);
+		if (t->token)
+			ofs[n] = t->token - wsi->hdr_buf;
+	}
+
+	p = realloc(wsi->hdr_buf, alloc);
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory for headers\n");
+		return -1;
+	}
+	wsi->hdr_buf = p;
+	wsi->hdr_buf_alloc = alloc;
+
+	for (n = 0; n < count; n++) {
+		t = lws_hdr_token(wsi, n);
+		if (t->token)
+			t->token = p + ofs[n];
+	}
+
+	return 0;
+}
+
+/* begin collecting the value of header n at the end of hdr_buf */
+
+static int
+lws_hdr_start(struct libwebsocket *wsi, int n)
+{
+	struct lws_tokens *t;
+	int m;
+
+	if (n >= WSI_TOKEN_COUNT && wsi->user_token == NULL) {
+		wsi->user_token = calloc(LWS_MAX_USER_HEADERS,
+						     sizeof(struct lws_tokens));
+		if (wsi->user_token == NULL) {
+			fprintf(stderr, "Out of memory for headers\n");
+			return -1;
+		}
+	}
+	t = lws_hdr_token(wsi, n);
+
+	m = lws_hdr_reserve(wsi, t->token_len + 1);
+	if (m)
+		return m;
+
+	/* if the header has been seen already, it continues at the end */
+
+	if (t->token)
+		memcpy(wsi->hdr_buf + wsi->hdr_buf_len, t->token, t->token_len);
+	t->token = wsi->hdr_buf + wsi->hdr_buf_len;
+	wsi->hdr_buf_len += t->token_len;
+	wsi->hdr_buf[wsi->hdr_buf_len] = '\0';
+
+	return 0;
+}
+
+static int
+lws_hdr_append(struct libwebsocket *wsi, const unsigned char *p, int len)
+{
+	struct lws_tokens *t = lws_hdr_current(wsi);
+	int n;
+
+	if (t->token_len + len >= LWS_MAX_HEADER_LEN)
+		n = 1;
+	else
+		n = lws_hdr_reserve(wsi, len + 1);
+	if (n < 0)
+		return n;
+	if (n) {
+		/* it's waaay to much payload, drop the value and skip it */
+		debug("header %d too long\n", wsi->parser_state);
+		wsi->hdr_buf_len -= t->token_len;
+		t->token_len = 0;
+		wsi->hdr_buf[wsi->hdr_buf_len++] = '\0';
+		wsi->parser_state = WSI_TOKEN_SKIPPING;
+		return 0;
+	}
+
+	memcpy(wsi->hdr_buf + wsi->hdr_buf_len, p, len);
+	wsi->hdr_buf_len += len;
+	t->token_len += len;
+	wsi->hdr_buf[wsi->hdr_buf_len] = '\0';
+
+	return 0;
+}
+
+/* the value is complete, keep its terminating NUL */
+
+static void
+lws_hdr_end(struct libwebsocket *wsi)
+{
+	wsi->hdr_buf_len++;
+}
+
+static void
+lws_hdr_drop_challenge(struct libwebsocket *wsi)
+{
+	wsi->utf8_token[WSI_TOKEN_CHALLENGE].token_len = 0;
+	wsi->utf8_token[WSI_TOKEN_CHALLENGE].token = NULL;
+}
+
+static int
+lws_hdr_version(struct libwebsocket *wsi)
+{
+	if (!wsi->utf8_token[WSI_TOKEN_VERSION].token_len)
+		return -1;
+
+	return atoi(wsi->utf8_token[WSI_TOKEN_VERSION].token);
+}
+
+/*
+ * name includes its delimiter.  Returns the lws_tokens[] index, or
+ * WSI_TOKEN_COUNT + the index of a user registered header, or -1
+ */
+
+static int
+lws_hdr_lookup(struct libwebsocket_context *context, const char *name, int len)
+{
+	const struct lws_tokens *t;
+	int h;
+	int n;
+
+	if (len < 2)
+		return -1;
+
+	h = LWS_HDR_HASH(name, len);
+	n = lws_token_hash[h] - 1;
+	if (n >= 0 && len == lws_tokens[n].token_len &&
+				 !strncasecmp(lws_tokens[n].token, name, len))
+		return n;
+
+	if (context == NULL || !context->count_user_headers)
+		return -1;
+
+	/* open addressing, the table is never full */
+
+	while (context->user_header_hash[h]) {
+		n = context->user_header_hash[h] - 1;
+		t = &context->user_headers[n];
+		if (len == t->token_len && !strncasecmp(t->token, name, len))
+			return WSI_TOKEN_COUNT + n;
+		h = (h + 1) & (LWS_HDR_HASH_SIZE - 1);
+	}
+
+	return -1;
+}
+
+/* the bytes a header name can end on, see lws_tokens[] */
+
+static int
+lws_hdr_name_end(unsigned char c)
+{
+	return c == ':' || c == ' ' || c == '\x0a';
+}
+
+/*
+ * a whole name has arrived, see if it's one we want and set up to collect
+ * its value if so
+ */
+
+static int
+lws_parse_name(struct libwebsocket_context *context, struct libwebsocket *wsi,
+							       unsigned char c)
+{
+	int n;
+	int m;
+
+	n = lws_hdr_lookup(context, wsi->name_buffer, wsi->name_buffer_pos);
+	if (n < 0) {
+		/* colon delimiter means we just don't know this name */
+		if (c == ':') {
+			debug("skipping unknown header '%s'\n",
+							      wsi->name_buffer);
+			wsi->parser_state = WSI_TOKEN_SKIPPING;
+		}
+		return 0;
+	}
+
+	debug("known hdr '%s'\n", wsi->name_buffer);
+
+	/*
+	 * WSORIGIN is protocol equiv to ORIGIN,
+	 * JWebSocket likes to send it, map to ORIGIN
+	 */
+	if (n == WSI_TOKEN_SWORIGIN)
+		n = WSI_TOKEN_ORIGIN;
+
+	m = lws_hdr_start(wsi, n);
+	if (m < 0)
+		return m;
+	if (m) {
+		wsi->parser_state = WSI_TOKEN_SKIPPING;
+		return 0;
+	}
+
+	if (n >= WSI_TOKEN_COUNT) {
+		wsi->user_token_current = n - WSI_TOKEN_COUNT;
+		wsi->parser_state = WSI_TOKEN_USER_HEADER;
+		return 0;
+	}
+
+	wsi->parser_state = WSI_TOKEN_GET_URI + n;
+
+	if (wsi->parser_state != WSI_TOKEN_CHALLENGE)
+		return 0;
+
+	/* don't look for payload when it can just be http headers */
+
+	if (!wsi->utf8_token[WSI_TOKEN_UPGRADE].token_len) {
+		/* they're HTTP headers, not websocket upgrade! */
+		debug("Setting WSI_PARSING_COMPLETE from http headers\n");
+		wsi->parser_state = WSI_PARSING_COMPLETE;
+	}
+
+	/* 04 version has no packet content after end of hdrs */
+
+	if (lws_hdr_version(wsi) >= 4) {
+		debug("04 header completed\n");
+		wsi->parser_state = WSI_PARSING_COMPLETE;
+		lws_hdr_drop_challenge(wsi);
+	}
+
+	/* client parser? */
+
+	if (wsi->ietf_spec_revision >= 4) {
+		debug("04 header completed\n");
+		wsi->parser_state = WSI_PARSING_COMPLETE;
+	}
+
+	return 0;
+}
+
+/*
+ * Rather than looking at one byte per call, header names are scanned up to
+ * their delimiter and values are found with memchr() and copied in one go.
+ * All state lives in the wsi, so the headers may arrive split at any point
+ * across any number of calls.
+ *
+ * Returns how many bytes of buf belong to the handshake, which is less than
+ * len only if parsing completed, or -1 on OOM.
+ */
+
+int
+lws_parse_span(struct libwebsocket_context *context, struct libwebsocket *wsi,
+					const unsigned char *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end = buf + len;
+	const unsigned char *q;
+	const unsigned char *sp;
+	struct lws_tokens *t;
+	int need;
+	int n;
+
+	while (p < end && wsi->parser_state != WSI_PARSING_COMPLETE) {
+
+		switch (wsi->parser_state) {
+		case WSI_TOKEN_GET_URI:
+		case WSI_TOKEN_HOST:
+		case WSI_TOKEN_CONNECTION:
+		case WSI_TOKEN_KEY1:
+		case WSI_TOKEN_KEY2:
+		case WSI_TOKEN_PROTOCOL:
+		case WSI_TOKEN_UPGRADE:
+		case WSI_TOKEN_ORIGIN:
+		case WSI_TOKEN_SWORIGIN:
+		case WSI_TOKEN_DRAFT:
+		case WSI_TOKEN_KEY:
+		case WSI_TOKEN_VERSION:
+		case WSI_TOKEN_ACCEPT:
+		case WSI_TOKEN_NONCE:
+		case WSI_TOKEN_EXTENSIONS:
+		case WSI_TOKEN_HTTP:
+		case WSI_TOKEN_MUXURL:
+		case WSI_TOKEN_USER_HEADER:
+
+			t = lws_hdr_current(wsi);
+
+			/* optional space swallow */
+			if (!t->token_len)
+				while (p < end && *p == ' ')
+					p++;
+			if (p == end)
+				break;
+
+			/* bail at EOL, get-uri also ends at a space */
+			q = memchr(p, '\x0d', end - p);
+			if (wsi->parser_state == WSI_TOKEN_GET_URI) {
+				sp = memchr(p, ' ', (q ? q : end) - p);
+				if (sp)
+					q = sp;
+			}
+
+			n = lws_hdr_append(wsi, p, (q ? q : end) - p);
+			if (n < 0)
+				return n;
+			if (wsi->parser_state == WSI_TOKEN_SKIPPING)
+				break;
+			if (q == NULL) {
+				p = end;
+				break;
+			}
+
+			lws_hdr_end(wsi);
+			if (*q == ' ')
+				wsi->parser_state = WSI_TOKEN_SKIPPING;
+			else
+				wsi->parser_state = WSI_TOKEN_SKIPPING_SAW_CR;
+			p = q + 1;
+			break;
+
+		case WSI_TOKEN_CHALLENGE:
+
+			/*
+			 * binary payload after the headers, only pre-04
+			 * handshakes get here: -76 and <= 03 servers want 8
+			 * bytes, a -76 client gets 16
+			 */
+
+			t = &wsi->utf8_token[WSI_TOKEN_CHALLENGE];
+			need = 8;
+			if (lws_hdr_version(wsi) < 0 && wsi->mode ==
+				      LWS_CONNMODE_WS_CLIENT_WAITING_SERVER_REPLY)
+				need = 16;
+			n = need - t->token_len;
+			if (n > end - p)
+				n = end - p;
+			if (lws_hdr_append(wsi, p, n) < 0)
+				return -1;
+			p += n;
+			if (t->token_len < need)
+				break;
+
+			lws_hdr_end(wsi);
+
+			/* no payload challenge in 01 + */
+
+			if (lws_hdr_version(wsi) > 0)
+				lws_hdr_drop_challenge(wsi);
+
+			/* For any supported protocol we have enough payload */
+
+			debug("Setting WSI_PARSING_COMPLETE\n");
+			wsi->parser_state = WSI_PARSING_COMPLETE;
+			break;
+
+		case WSI_INIT_TOKEN_MUXURL:
+			n = lws_hdr_start(wsi, WSI_TOKEN_MUXURL);
+			if (n < 0)
+				return n;
+			wsi->parser_state = WSI_TOKEN_MUXURL;
+			p++;
+			break;
+
+			/* collecting and checking a name part */
+		case WSI_TOKEN_NAME_PART:
+
+			q = p;
+			while (q < end && !lws_hdr_name_end(*q))
+				q++;
+			if (q < end)
+				q++;
+
+			n = q - p;
+			if (wsi->name_buffer_pos + n >
+					       sizeof(wsi->name_buffer) - 1) {
+				/* name bigger than we can handle, skip it */
+				p += sizeof(wsi->name_buffer) - 1 -
+							   wsi->name_buffer_pos;
+				wsi->parser_state = WSI_TOKEN_SKIPPING;
+				break;
+			}
+			memcpy(&wsi->name_buffer[wsi->name_buffer_pos], p, n);
+			wsi->name_buffer_pos += n;
+			wsi->name_buffer[wsi->name_buffer_pos] = '\0';
+			p = q;
+
+			if (!lws_hdr_name_end(q[-1]))
+				break;
+
+			n = lws_parse_name(context, wsi, q[-1]);
+			if (n < 0)
+				return n;
+			break;
+
+			/* skipping arg part of a name we didn't recognize */
+		case WSI_TOKEN_SKIPPING:
+			q = memchr(p, '\x0d', end - p);
+			if (q == NULL) {
+				p = end;
+				break;
+			}
+			wsi->parser_state = WSI_TOKEN_SKIPPING_SAW_CR;
+			p = q + 1;
+			break;
+
+		case WSI_TOKEN_SKIPPING_SAW_CR:
+			if (*p++ == '\x0a')
+				wsi->parser_state = WSI_TOKEN_NAME_PART;
+			else
+				wsi->parser_state = WSI_TOKEN_SKIPPING;
+			wsi->name_buffer_pos = 0;
+			break;
+
+		default:	/* keep gcc happy */
+			p++;
+			break;
+		}
+	}
+
+	return p - buf;
+}
+
+int libwebsocket_parse(struct libwebsocket_context *context,
+				  struct libwebsocket *wsi, unsigned char c)
+{
+	return lws_parse_span(context, wsi, &c, 1) < 0 ? -1 : 0;
+}
+
+/**
+ * libwebsocket_register_header() - have the handshake parser keep a header
+ * @context:	Websocket context
+ * @name:	header name including the colon, eg, "Cookie:"
+ *
+ *	Only the headers in lws_token_indexes are kept by default.  After
+ *	this, the value of @name is also kept for every connection the
+ *	context (or its service threads) handshakes from now on, and can be
+ *	read with libwebsocket_get_header() once the headers are parsed,
+ *	for example in LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION.  Matching
+ *	the built-in headers costs the same however many are registered.
+ *
+ *	Register headers from the thread that services the context, before
+ *	libwebsocket_service_threads_start() if you use service threads;
+ *	it fails while they are running.
+ *
+ *	Returns the index to give libwebsocket_get_header(), or -1 with
+ *	nothing registered.
+ */
+
+int
+libwebsocket_register_header(struct libwebsocket_context *context,
+							      const char *name)
+{
+	struct libwebsocket_context *member;
+	char **copies;
+	int len = strlen(name);
+	int count = 1;
+	int h;
+	int n;
+
+	if (len < 2 || len >= LWS_MAX_HEADER_NAME_LENGTH ||
+						       name[len - 1] != ':') {
+		fprintf(stderr, "Header name '%s' must end in ':' and be "
+			     "shorter than %d\n", name, LWS_MAX_HEADER_NAME_LENGTH);
+		return -1;
+	}
+
+	n = lws_hdr_lookup(context, name, len);
+	if (n >= 0)
+		return n;
+
+	if (context->count_user_headers == LWS_MAX_USER_HEADERS) {
+		fprintf(stderr, "Only %d headers may be registered\n",
+							 LWS_MAX_USER_HEADERS);
+		return -1;
+	}
+
+	if (context->service_group)
+		count = context->service_group_count;
+
+#ifdef LWS_HAS_SERVICE_THREADS
+	/* the tables are read without locking by the service threads */
+
+	for (n = 0; n < count; n++) {
+		member = context;
+		if (context->service_group)
+			member = context->service_group[n];
+		if (member->service_thread_running) {
+			fprintf(stderr, "Headers must be registered before "
+				   "libwebsocket_service_threads_start()\n");
+			return -1;
+		}
+	}
+#endif
+
+	/* get every allocation first, so failing leaves nothing changed */
+
+	copies = malloc(count * sizeof(*copies));
+	if (copies == NULL)
+		return -1;
+	for (n = 0; n < count; n++) {
+		copies[n] = strdup(name);
+		if (copies[n] == NULL) {
+			while (n--)
+				free(copies[n]);
+			free(copies);
+			return -1;
+		}
+	}
+
+	for (n = 0; n < count; n++) {
+		member = context;
+		if (context->service_group)
+			member = context->service_group[n];
+
+		member->user_headers[member->count_user_headers].token =
+								     copies[n];
+		member->user_headers[member->count_user_headers].token_len =
+									   len;
+
+		h = LWS_HDR_HASH(name, len);
+		while (member->user_header_hash[h])
+			h = (h + 1) & (LWS_HDR_HASH_SIZE - 1);
+		member->user_header_hash[h] = ++member->count_user_headers;
+	}
+	free(copies);
+
+	return WSI_TOKEN_COUNT + context->count_user_headers - 1;
+}
+
+/**
+ * libwebsocket_get_header() - read a header from the handshake
+ * @wsi:	Websocket connection instance
+ * @index:	a lws_token_indexes value, or one returned by
+ *		libwebsocket_register_header()
+ * @len:	if not NULL, set to the length of the value
+ *
+ *	Returns the NUL terminated header value, or NULL if the header was
+ *	not in the handshake.
+ */
+
+const char *
+libwebsocket_get_header(struct libwebsocket *wsi, int index, int *len)
+{
+	struct lws_tokens *t;
+
+	if (index < 0 || index >= WSI_TOKEN_COUNT + LWS_MAX_USER_HEADERS)
+		return NULL;
+	if (index >= WSI_TOKEN_COUNT && wsi->user_token == NULL)
+		return NULL;
+
+	t = lws_hdr_token(wsi, index);
+	if (t->token == NULL)
+		return NULL;
+
+	if (len)
+		*len = t->token_len;
+
+	return t->token;
+}
+
+unsigned char
+xor_no_mask(struct libwebsocket *wsi, unsigned char c)
+{
+	return c;
+}
+
+unsigned char
+xor_mask_04(struct libwebsocket *wsi, unsigned char c)
+{
+	c ^= wsi->masking_key_04[wsi->frame_mask_index++];
+	if (wsi->frame_mask_index == 20)
+		wsi->frame_mask_index = 0;
+
+	return c;
+}
+
+unsigned char
+xor_mask_05(struct libwebsocket *wsi, unsigned char c)
+{
+	return c ^ wsi->frame_masking_nonce_04[(wsi->frame_mask_index++) & 3];
+}
+
+/*
+ * Bulk 05+ masking kernels: dst[n] = src[n] ^ key[(idx + n) & 3], with dst
+ * allowed to equal src and no alignment requirement on either.  They return
+ * the key index to carry on from.  The key is widened to the kernel's word
+ * size already rotated by idx, since any multiple of four bytes leaves the
+ * rotation where it was.
+ */
+
+static unsigned char
+lws_mask_span_word(unsigned char *dst, const unsigned char *src, size_t len,
+				      const unsigned char *key, unsigned char idx)
+{
+	unsigned long long k;
+	unsigned long long w;
+	unsigned char kb[8];
+	size_t n = 0;
+	int m;
+
+	for (m = 0; m < 8; m++)
+		kb[m] = key[(idx + m) & 3];
+	memcpy(&k, kb, 8);
+
+	for (; n + 8 <= len; n += 8) {
+		memcpy(&w, src + n, 8);
+		w ^= k;
+		memcpy(dst + n, &w, 8);
+	}
+
+	for (m = 0; n < len; n++)
+		dst[n] = src[n] ^ kb[m++];
+
+	return idx + len;
+}
+
+#ifdef LWS_X86_KERNELS
+
+__attribute__((target("sse2")))
+static unsigned char
+lws_mask_span_sse2(unsigned char *dst, const unsigned char *src, size_t len,
+				      const unsigned char *key, unsigned char idx)
+{
+	unsigned char kb[16];
+	__m128i k;
+	size_t n = 0;
+	int m;
+
+	for (m = 0; m < 16; m++)
+		kb[m] = key[(idx + m) & 3];
+	k = _mm_loadu_si128((const __m128i *)kb);
+
+	for (; n + 16 <= len; n += 16)
+		_mm_storeu_si128((__m128i *)(dst + n), _mm_xor_si128(k,
+				   _mm_loadu_si128((const __m128i *)(src + n))));
+
+	return lws_mask_span_word(dst + n, src + n, len - n, key, idx + n);
+}
+
+__attribute__((target("avx2")))
+static unsigned char
+lws_mask_span_avx2(unsigned char *dst, const unsigned char *src, size_t len,
+				      const unsigned char *key, unsigned char idx)
+{
+	unsigned char kb[32];
+	__m256i k;
+	size_t n = 0;
+	int m;
+
+	for (m = 0; m < 32; m++)
+		kb[m] = key[(idx + m) & 3];
+	k = _mm256_loadu_si256((const __m256i *)kb);
+
+	for (; n + 32 <= len; n += 32)
+		_mm256_storeu_si256((__m256i *)(dst + n), _mm256_xor_si256(k,
+				_mm256_loadu_si256((const __m256i *)(src + n))));
+
+	return lws_mask_span_sse2(dst + n, src + n, len - n, key, idx + n);
+}
+
+#endif
+
+unsigned char (*lws_mask_span)(unsigned char *dst, const unsigned char *src,
+			       size_t len, const unsigned char *key,
+			       unsigned char idx) = lws_mask_span_word;
+
+/*
+ * ASCII skipping kernels for UTF-8 validation: they return how many bytes
+ * at the start of p are all below 0x80, in whole blocks, so they may stop
+ * short of the real end of the ASCII run
+ */
+
+static size_t
+lws_ascii_span_word(const unsigned char *p, size_t len)
+{
+	unsigned long long w;
+	size_t n = 0;
+
+	for (; n + 8 <= len; n += 8) {
+		memcpy(&w, p + n, 8);
+		if (w & 0x8080808080808080ULL)
+			break;
+	}
+
+	return n;
+}
+
+#ifdef LWS_X86_KERNELS
+
+__attribute__((target("sse2")))
+static size_t
+lws_ascii_span_sse2(const unsigned char *p, size_t len)
+{
+	size_t n = 0;
+
+	for (; n + 16 <= len; n += 16)
+		if (_mm_movemask_epi8(
+				 _mm_loadu_si128((const __m128i *)(p + n))))
+			return n;
+
+	return n + lws_ascii_span_word(p + n, len - n);
+}
+
+__attribute__((target("avx2")))
+static size_t
+lws_ascii_span_avx2(const unsigned char *p, size_t len)
+{
+	size_t n = 0;
+
+	for (; n + 32 <= len; n += 32)
+		if (_mm256_movemask_epi8(
+			      _mm256_loadu_si256((const __m256i *)(p + n))))
+			return n + lws_ascii_span_sse2(p + n, len - n);
+
+	return n + lws_ascii_span_sse2(p + n, len - n);
+}
+
+#endif
+
+size_t (*lws_ascii_span)(const unsigned char *p, size_t len) =
+							   lws_ascii_span_word;
+
+/*
+ * pick the widest kernels this cpu can run; called at each context
+ * creation, until then the portable word kernels are used
+ */
 
-int libwebsocket_parse(struct libwebsocket *wsi, unsigned char c)
+void
+lws_select_kernels(void)
 {
-	int n;
+#ifdef LWS_X86_KERNELS
+	unsigned char (*mask)(unsigned char *, const unsigned char *,
+			   size_t, const unsigned char *, unsigned char) =
+							lws_mask_span_word;
+	size_t (*ascii)(const unsigned char *, size_t) = lws_ascii_span_word;
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		mask = lws_mask_span_avx2;
+		ascii = lws_ascii_span_avx2;
+	} else
+		if (__builtin_cpu_supports("sse2")) {
+			mask = lws_mask_span_sse2;
+			ascii = lws_ascii_span_sse2;
+		}
 
-	switch (wsi->parser_state) {
-	case WSI_TOKEN_GET_URI:
-	case WSI_TOKEN_HOST:
-	case WSI_TOKEN_CONNECTION:
-	case WSI_TOKEN_KEY1:
-	case WSI_TOKEN_KEY2:
-	case WSI_TOKEN_PROTOCOL:
-	case WSI_TOKEN_UPGRADE:
-	case WSI_TOKEN_ORIGIN:
-	case WSI_TOKEN_SWORIGIN:
-	case WSI_TOKEN_DRAFT:
-	case WSI_TOKEN_CHALLENGE:
-	case WSI_TOKEN_KEY:
-	case WSI_TOKEN_VERSION:
-	case WSI_TOKEN_ACCEPT:
-	case WSI_TOKEN_NONCE:
-	case WSI_TOKEN_EXTENSIONS:
-	case WSI_TOKEN_HTTP:
-	case WSI_TOKEN_MUXURL:
-
-		debug("WSI_TOKEN_(%d) '%c'\n", wsi->parser_state, c);
-
-		/* collect into malloc'd buffers */
-		/* optional space swallow */
-		if (!wsi->utf8_token[wsi->parser_state].token_len && c == ' ')
-			break;
+	/* later contexts may be created while others are servicing */
+	if (lws_mask_span != mask)
+		lws_mask_span = mask;
+	if (lws_ascii_span != ascii)
+		lws_ascii_span = ascii;
+#endif
+}
 
-		/* special case space terminator for get-uri */
-		if (wsi->parser_state == WSI_TOKEN_GET_URI && c == ' ') {
-			wsi->utf8_token[wsi->parser_state].token[
-			   wsi->utf8_token[wsi->parser_state].token_len] = '\0';
-			wsi->parser_state = WSI_TOKEN_SKIPPING;
-			break;
-		}
+/*
+ * UTF-8 (RFC 3629) validation that can stop and carry on anywhere.  State
+ * 0 is between characters, 1 - 3 want that many more continuation bytes
+ * and 4 - 7 are the second byte of E0, ED, F0 and F4 sequences, which have
+ * a narrower range to rule out overlongs, surrogates and > U+10FFFF.
+ */
 
-		/* allocate appropriate memory */
-		if (wsi->utf8_token[wsi->parser_state].token_len ==
-						   wsi->current_alloc_len - 1) {
-			/* need to extend */
-			wsi->current_alloc_len += LWS_ADDITIONAL_HDR_ALLOC;
-			if (wsi->current_alloc_len >= LWS_MAX_HEADER_LEN) {
-				/* it's waaay to much payload, fail it */
-				strcpy(wsi->utf8_token[wsi->parser_state].token,
-				   "!!! Length exceeded maximum supported !!!");
-				wsi->parser_state = WSI_TOKEN_SKIPPING;
+#define LWS_UTF8_REJECT 8
+
+static const unsigned char utf8_lo[] =
+			{ 0, 0x80, 0x80, 0x80, 0xa0, 0x80, 0x90, 0x80 };
+static const unsigned char utf8_hi[] =
+			{ 0, 0xbf, 0xbf, 0xbf, 0xbf, 0x9f, 0xbf, 0x8f };
+static const unsigned char utf8_next[] = { 0, 0, 1, 2, 1, 1, 2, 2 };
+
+unsigned char
+lws_utf8_validate(unsigned char state, const unsigned char *p, size_t len)
+{
+	size_t n = 0;
+	unsigned char c;
+
+	while (n < len) {
+		if (!state && p[n] < 0x80) {
+			n += lws_ascii_span(p + n, len - n);
+			if (n == len)
 				break;
-			}
-			wsi->utf8_token[wsi->parser_state].token =
-			       realloc(wsi->utf8_token[wsi->parser_state].token,
-							wsi->current_alloc_len);
 		}
 
-		/* bail at EOL */
-		if (wsi->parser_state != WSI_TOKEN_CHALLENGE && c == '\x0d') {
-			wsi->utf8_token[wsi->parser_state].token[
-			   wsi->utf8_token[wsi->parser_state].token_len] = '\0';
-			wsi->parser_state = WSI_TOKEN_SKIPPING_SAW_CR;
-			debug("*\n");
-			break;
+		c = p[n++];
+
+		if (state) {
+			if (c < utf8_lo[state] || c > utf8_hi[state])
+				return LWS_UTF8_REJECT;
+			state = utf8_next[state];
+			continue;
 		}
 
-		wsi->utf8_token[wsi->parser_state].token[
-			    wsi->utf8_token[wsi->parser_state].token_len++] = c;
+		if (c < 0x80)
+			continue;
+		if (c < 0xc2)
+			return LWS_UTF8_REJECT;
+		if (c < 0xe0)
+			state = 1;
+		else if (c == 0xe0)
+			state = 4;
+		else if (c == 0xed)
+			state = 5;
+		else if (c < 0xf0)
+			state = 2;
+		else if (c == 0xf0)
+			state = 6;
+		else if (c < 0xf4)
+			state = 3;
+		else if (c == 0xf4)
+			state = 7;
+		else
+			return LWS_UTF8_REJECT;
+	}
 
-		/* per-protocol end of headers management */
+	return state;
+}
 
-		if (wsi->parser_state != WSI_TOKEN_CHALLENGE)
-			break;
 
-		/* -76 has no version header ... server */
-		if (!wsi->utf8_token[WSI_TOKEN_VERSION].token_len &&
-		   wsi->mode != LWS_CONNMODE_WS_CLIENT_WAITING_SERVER_REPLY &&
-			      wsi->utf8_token[wsi->parser_state].token_len != 8)
-			break;
 
-		/* -76 has no version header ... client */
-		if (!wsi->utf8_token[WSI_TOKEN_VERSION].token_len &&
-		   wsi->mode == LWS_CONNMODE_WS_CLIENT_WAITING_SERVER_REPLY &&
-			wsi->utf8_token[wsi->parser_state].token_len != 16)
-			break;
+/*
+ * The receive buffer is allocated when payload first needs it and kept
+ * while the connection keeps receiving; lws_rx_buffers_idle() gives it
+ * back once nothing has arrived for LWS_RX_BUFFER_IDLE_SECS.  Its size
+ * comes from the protocol's rx_buffer_size, which also decides how much
+ * payload each receive callback can carry.
+ */
 
-		/* <= 03 has old handshake with version header needs 8 bytes */
-		if (wsi->utf8_token[WSI_TOKEN_VERSION].token_len &&
-			 atoi(wsi->utf8_token[WSI_TOKEN_VERSION].token) < 4 &&
-			      wsi->utf8_token[wsi->parser_state].token_len != 8)
-			break;
+int
+lws_rx_buffer_alloc(struct libwebsocket *wsi)
+{
+	struct libwebsocket_context *context;
+	int size = MAX_USER_RX_BUFFER;
+
+	if (wsi->protocol && wsi->protocol->rx_buffer_size)
+		size = wsi->protocol->rx_buffer_size;
+	if (size < MIN_USER_RX_BUFFER)
+		size = MIN_USER_RX_BUFFER;
+
+	wsi->rx_user_buffer = malloc(LWS_SEND_BUFFER_PRE_PADDING + size +
+						 LWS_SEND_BUFFER_POST_PADDING);
+	if (!wsi->rx_user_buffer) {
+		fprintf(stderr, "Out of memory for rx buffer\n");
+		return -1;
+	}
+	wsi->rx_user_buffer_size = size;
+	wsi->rx_user_buffer_idle = 0;
 
-		/* no payload challenge in 01 + */
+	if (!wsi->protocol)
+		return 0;
 
-		if (wsi->utf8_token[WSI_TOKEN_VERSION].token_len &&
-			   atoi(wsi->utf8_token[WSI_TOKEN_VERSION].token) > 0) {
-			wsi->utf8_token[WSI_TOKEN_CHALLENGE].token_len = 0;
-			free(wsi->utf8_token[WSI_TOKEN_CHALLENGE].token);
-			wsi->utf8_token[WSI_TOKEN_CHALLENGE].token = NULL;
-		}
+	/* so the 1Hz service can find it again when we go quiet */
 
-		/* For any supported protocol we have enough payload */
+	context = wsi->protocol->owning_server;
+	wsi->rx_buffer_next = context->rx_buffer_list;
+	if (context->rx_buffer_list)
+		context->rx_buffer_list->rx_buffer_prev = &wsi->rx_buffer_next;
+	context->rx_buffer_list = wsi;
+	wsi->rx_buffer_prev = &context->rx_buffer_list;
 
-		debug("Setting WSI_PARSING_COMPLETE\n");
-		wsi->parser_state = WSI_PARSING_COMPLETE;
-		break;
+	return 0;
+}
 
-	case WSI_INIT_TOKEN_MUXURL:
-		wsi->parser_state = WSI_TOKEN_MUXURL;
-		wsi->current_alloc_len = LWS_INITIAL_HDR_ALLOC;
+void
+lws_rx_buffer_free(struct libwebsocket *wsi)
+{
+	if (wsi->rx_user_buffer)
+		free(wsi->rx_user_buffer);
+	wsi->rx_user_buffer = NULL;
+	wsi->rx_user_buffer_size = 0;
+
+	if (wsi->rx_buffer_prev == NULL)
+		return;
+
+	*wsi->rx_buffer_prev = wsi->rx_buffer_next;
+	if (wsi->rx_buffer_next)
+		wsi->rx_buffer_next->rx_buffer_prev = wsi->rx_buffer_prev;
+	wsi->rx_buffer_next = NULL;
+	wsi->rx_buffer_prev = NULL;
+}
 
-		wsi->utf8_token[wsi->parser_state].token =
-					 malloc(wsi->current_alloc_len);
-		wsi->utf8_token[wsi->parser_state].token_len = 0;
-		break;
+/*
+ * lws_rx_buffers_idle() - called once a second, frees the rx buffer of
+ *			   connections that have received nothing for a while
+ *			   and are not holding part of a frame in it
+ */
 
-		/* collecting and checking a name part */
-	case WSI_TOKEN_NAME_PART:
-		debug("WSI_TOKEN_NAME_PART '%c'\n", c);
+void
+lws_rx_buffers_idle(struct libwebsocket_context *context)
+{
+	struct libwebsocket *wsi;
+	struct libwebsocket *next_wsi;
 
-		if (wsi->name_buffer_pos == sizeof(wsi->name_buffer) - 1) {
-			/* name bigger than we can handle, skip until next */
-			wsi->parser_state = WSI_TOKEN_SKIPPING;
-			break;
-		}
-		wsi->name_buffer[wsi->name_buffer_pos++] = c;
-		wsi->name_buffer[wsi->name_buffer_pos] = '\0';
+	for (wsi = context->rx_buffer_list; wsi; wsi = next_wsi) {
+		next_wsi = wsi->rx_buffer_next;
+		if (wsi->lws_rx_parse_state != LWS_RXPS_NEW ||
+						       wsi->rx_user_buffer_head)
+			continue;
+		if (++wsi->rx_user_buffer_idle >= LWS_RX_BUFFER_IDLE_SECS)
+			lws_rx_buffer_free(wsi);
+	}
+}
 
-		for (n = 0; n < WSI_TOKEN_COUNT; n++) {
-			if (wsi->name_buffer_pos != lws_tokens[n].token_len)
-				continue;
-			if (strcasecmp(lws_tokens[n].token, wsi->name_buffer))
-				continue;
-			debug("known hdr '%s'\n", wsi->name_buffer);
+/*
+ * continuation frames carry on the text-ness of the message they belong to
+ */
 
-			/*
-			 * WSORIGIN is protocol equiv to ORIGIN,
-			 * JWebSocket likes to send it, map to ORIGIN
-			 */
-			if (n == WSI_TOKEN_SWORIGIN)
-				n = WSI_TOKEN_ORIGIN;
+static int
+lws_rx_is_text(struct libwebsocket *wsi)
+{
+	if (wsi->opcode == LWS_WS_OPCODE_07__TEXT_FRAME)
+		wsi->rx_text = 1;
+	if (wsi->opcode == LWS_WS_OPCODE_07__BINARY_FRAME)
+		wsi->rx_text = 0;
 
-			wsi->parser_state = WSI_TOKEN_GET_URI + n;
+	return wsi->rx_text;
+}
 
-			n = WSI_TOKEN_COUNT;
+/*
+ * LWS_PROTOCOL_OPTION_RX_VALIDATE_UTF8: check the next piece of a text
+ * message before the user sees it, end says it's the last piece
+ */
 
-			/*  If the header has been seen already, just append */
-			if (wsi->utf8_token[wsi->parser_state].token)
-				continue;
+static int
+lws_rx_check_utf8(struct libwebsocket *wsi, const unsigned char *p,
+							size_t len, int end)
+{
+	if (!(wsi->protocol->options & LWS_PROTOCOL_OPTION_RX_VALIDATE_UTF8) ||
+							 !lws_rx_is_text(wsi))
+		return 0;
 
-			wsi->current_alloc_len = LWS_INITIAL_HDR_ALLOC;
-			wsi->utf8_token[wsi->parser_state].token =
-						 malloc(wsi->current_alloc_len);
-			wsi->utf8_token[wsi->parser_state].token_len = 0;
-		}
+	wsi->utf8_state = lws_utf8_validate(wsi->utf8_state, p, len);
+	if (wsi->utf8_state != LWS_UTF8_REJECT && !(end && wsi->utf8_state))
+		return 0;
 
-		/* colon delimiter means we just don't know this name */
+	fprintf(stderr, "Text message is not valid UTF-8\n");
+	wsi->utf8_state = 0;
+	/* the caller closes, sending this reason */
+	wsi->close_reason = LWS_CLOSE_STATUS_INVALID_PAYLOAD;
 
-		if (wsi->parser_state == WSI_TOKEN_NAME_PART && c == ':') {
-			debug("skipping unknown header '%s'\n",
-							      wsi->name_buffer);
-			wsi->parser_state = WSI_TOKEN_SKIPPING;
-			break;
-		}
+	return -1;
+}
 
-		if (wsi->parser_state != WSI_TOKEN_CHALLENGE)
-			break;
+/*
+ * LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE gathers data frame payload here until
+ * the final fragment, then makes a single receive callback for all of it
+ */
 
-		/* don't look for payload when it can just be http headers */
+static int
+lws_rx_message_append(struct libwebsocket *wsi, const unsigned char *src,
+							size_t len, int unmask)
+{
+	size_t max = LWS_DEFAULT_MAX_MESSAGE;
+	size_t alloc;
+	unsigned char *p;
 
-		if (!wsi->utf8_token[WSI_TOKEN_UPGRADE].token_len) {
-			/* they're HTTP headers, not websocket upgrade! */
-			debug("Setting WSI_PARSING_COMPLETE "
-							 "from http headers\n");
-			wsi->parser_state = WSI_PARSING_COMPLETE;
-		}
+	if (wsi->protocol->rx_max_message_size)
+		max = wsi->protocol->rx_max_message_size;
 
-		/* 04 version has no packet content after end of hdrs */
+	lws_rx_is_text(wsi);
 
-		if (wsi->utf8_token[WSI_TOKEN_VERSION].token_len &&
-			 atoi(wsi->utf8_token[WSI_TOKEN_VERSION].token) >= 4) {
-			debug("04 header completed\n");
-			wsi->parser_state = WSI_PARSING_COMPLETE;
-			wsi->utf8_token[WSI_TOKEN_CHALLENGE].token_len = 0;
-			free(wsi->utf8_token[WSI_TOKEN_CHALLENGE].token);
-			wsi->utf8_token[WSI_TOKEN_CHALLENGE].token = NULL;
+	if (wsi->rx_msg_len + len > max) {
+		fprintf(stderr, "Message larger than limit of %lu\n",
+							   (unsigned long)max);
+		/* the caller closes, sending this reason */
+		wsi->close_reason = LWS_CLOSE_STATUS_PAYLOAD_TOO_LARGE;
+		return -1;
+	}
+
+	if (!wsi->rx_msg || wsi->rx_msg_len + len > wsi->rx_msg_alloc) {
+		alloc = wsi->rx_msg_alloc;
+		if (!alloc)
+			alloc = LWS_RX_MESSAGE_INITIAL;
+		while (alloc < wsi->rx_msg_len + len)
+			alloc *= 2;
+		if (alloc > max)
+			alloc = max;
+
+		p = realloc(wsi->rx_msg, LWS_SEND_BUFFER_PRE_PADDING + alloc +
+						 LWS_SEND_BUFFER_POST_PADDING);
+		if (!p) {
+			fprintf(stderr, "Out of memory for rx message\n");
+			return -1;
 		}
+		wsi->rx_msg = p;
+		wsi->rx_msg_alloc = alloc;
+	}
 
-		/* client parser? */
+	p = &wsi->rx_msg[LWS_SEND_BUFFER_PRE_PADDING + wsi->rx_msg_len];
+	if (unmask)
+		wsi->frame_mask_index = lws_mask_span(p, src, len,
+						 wsi->frame_masking_nonce_04,
+						       wsi->frame_mask_index);
+	else
+		memcpy(p, src, len);
+	wsi->rx_msg_len += len;
 
-		if (wsi->ietf_spec_revision >= 4) {
-			debug("04 header completed\n");
-			wsi->parser_state = WSI_PARSING_COMPLETE;
-		}
+	return 0;
+}
 
-		break;
+static int
+lws_rx_message_deliver(struct libwebsocket *wsi, int client)
+{
+	if (lws_rx_check_utf8(wsi, &wsi->rx_msg[LWS_SEND_BUFFER_PRE_PADDING],
+							   wsi->rx_msg_len, 1))
+		return -1;
 
-		/* skipping arg part of a name we didn't recognize */
-	case WSI_TOKEN_SKIPPING:
-		debug("WSI_TOKEN_SKIPPING '%c'\n", c);
-		if (c == '\x0d')
-			wsi->parser_state = WSI_TOKEN_SKIPPING_SAW_CR;
-		break;
-	case WSI_TOKEN_SKIPPING_SAW_CR:
-		debug("WSI_TOKEN_SKIPPING_SAW_CR '%c'\n", c);
-		if (c == '\x0a')
-			wsi->parser_state = WSI_TOKEN_NAME_PART;
-		else
-			wsi->parser_state = WSI_TOKEN_SKIPPING;
-		wsi->name_buffer_pos = 0;
-		break;
-		/* we're done, ignore anything else */
-	case WSI_PARSING_COMPLETE:
-		debug("WSI_PARSING_COMPLETE '%c'\n", c);
-		break;
+	wsi->rx_msg[LWS_SEND_BUFFER_PRE_PADDING + wsi->rx_msg_len] = '\0';
 
-	default:	/* keep gcc happy */
-		break;
-	}
+	if (wsi->protocol->callback)
+		wsi->protocol->callback(wsi->protocol->owning_server, wsi,
+			client ? LWS_CALLBACK_CLIENT_RECEIVE :
+			LWS_CALLBACK_RECEIVE, wsi->user_space,
+			&wsi->rx_msg[LWS_SEND_BUFFER_PRE_PADDING],
+							      wsi->rx_msg_len);
+
+	/* the next message reuses the buffer, unless it got big */
+
+	wsi->rx_msg_len = 0;
+	if (wsi->rx_msg_alloc > LWS_RX_MESSAGE_KEEP)
+		lws_rx_message_free(wsi);
 
 	return 0;
 }
 
-unsigned char
-xor_no_mask(struct libwebsocket *wsi, unsigned char c)
-{
-	return c;
-}
+/*
+ * called at spill time with the data frame payload gathered so far in
+ * rx_user_buffer; if the frame is over and it was the final fragment, the
+ * message goes to the user
+ */
 
-unsigned char
-xor_mask_04(struct libwebsocket *wsi, unsigned char c)
+static int
+lws_rx_message_spill(struct libwebsocket *wsi, int client)
 {
-	c ^= wsi->masking_key_04[wsi->frame_mask_index++];
-	if (wsi->frame_mask_index == 20)
-		wsi->frame_mask_index = 0;
+	if (lws_rx_message_append(wsi, (unsigned char *)
+		&wsi->rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING],
+					      wsi->rx_user_buffer_head, 0))
+		return -1;
 
-	return c;
+	wsi->rx_user_buffer_head = 0;
+
+	if (wsi->lws_rx_parse_state == LWS_RXPS_NEW && wsi->final)
+		return lws_rx_message_deliver(wsi, client);
+
+	return 0;
 }
 
-unsigned char
-xor_mask_05(struct libwebsocket *wsi, unsigned char c)
+void
+lws_rx_message_free(struct libwebsocket *wsi)
 {
-	return c ^ wsi->frame_masking_nonce_04[(wsi->frame_mask_index++) & 3];
+	if (wsi->rx_msg)
+		free(wsi->rx_msg);
+	wsi->rx_msg = NULL;
+	wsi->rx_msg_len = 0;
+	wsi->rx_msg_alloc = 0;
 }
 
-
-
 int
 libwebsocket_rx_sm(struct libwebsocket *wsi, unsigned char c)
 {
@@ -308,6 +1196,9 @@ libwebsocket_rx_sm(struct libwebsocket *wsi, unsigned char c)
 	fprintf(stderr, "RX: %02X ", c);
 #endif
 
+	if (!wsi->rx_user_buffer && lws_rx_buffer_alloc(wsi))
+		return -1;
+
 	switch (wsi->lws_rx_parse_state) {
 	case LWS_RXPS_NEW:
 
@@ -642,7 +1533,7 @@ handle_first:
 		wsi->rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING +
 					      (wsi->rx_user_buffer_head++)] = c;
 
-		if (wsi->rx_user_buffer_head != MAX_USER_RX_BUFFER)
+		if (wsi->rx_user_buffer_head != wsi->rx_user_buffer_size)
 			break;
 issue:
 		if (wsi->protocol->callback)
@@ -699,9 +1590,14 @@ issue:
 		wsi->frame_masking_nonce_04[3] = c;
 		if (c)
 			wsi->all_zero_nonce = 0;
-		wsi->lws_rx_parse_state =
-					LWS_RXPS_PAYLOAD_UNTIL_LENGTH_EXHAUSTED;
 		wsi->frame_mask_index = 0;
+		if (wsi->rx_packet_length)
+			wsi->lws_rx_parse_state =
+					LWS_RXPS_PAYLOAD_UNTIL_LENGTH_EXHAUSTED;
+		else {
+			wsi->lws_rx_parse_state = LWS_RXPS_NEW;
+			goto spill;
+		}
 		break;
 
 
@@ -719,7 +1615,7 @@ issue:
 			wsi->lws_rx_parse_state = LWS_RXPS_NEW;
 			goto spill;
 		}
-		if (wsi->rx_user_buffer_head != MAX_USER_RX_BUFFER)
+		if (wsi->rx_user_buffer_head != wsi->rx_user_buffer_size)
 			break;
 spill:
 		/*
@@ -765,8 +1661,12 @@ spill:
 			wsi->rx_user_buffer_head = 0;
 			return 0;
 
+		case LWS_WS_OPCODE_07__CONTINUATION:
 		case LWS_WS_OPCODE_07__TEXT_FRAME:
 		case LWS_WS_OPCODE_07__BINARY_FRAME:
+			if (wsi->protocol->options &
+					  LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE)
+				return lws_rx_message_spill(wsi, 0);
 			break;
 
 		default:
@@ -809,6 +1709,13 @@ spill:
 		 * so it can be sent straight out again using libwebsocket_write
 		 */
 
+		if (lws_rx_check_utf8(wsi, (unsigned char *)
+			    &wsi->rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING],
+			      wsi->rx_user_buffer_head,
+			      wsi->lws_rx_parse_state == LWS_RXPS_NEW &&
+								  wsi->final))
+			return -1;
+
 		wsi->rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING +
 					       wsi->rx_user_buffer_head] = '\0';
 
@@ -847,6 +1754,9 @@ int libwebsocket_client_rx_sm(struct libwebsocket *wsi, unsigned char c)
 
 	debug(" CRX: %02X %d\n", c, wsi->lws_rx_parse_state);
 
+	if (!wsi->rx_user_buffer && lws_rx_buffer_alloc(wsi))
+		return -1;
+
 	switch (wsi->lws_rx_parse_state) {
 	case LWS_RXPS_NEW:
 
@@ -1139,7 +2049,7 @@ int libwebsocket_client_rx_sm(struct libwebsocket *wsi, unsigned char c)
 		wsi->rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING +
 					      (wsi->rx_user_buffer_head++)] = c;
 
-		if (wsi->rx_user_buffer_head != MAX_USER_RX_BUFFER)
+		if (wsi->rx_user_buffer_head != wsi->rx_user_buffer_size)
 			break;
 issue:
 		if (wsi->protocol->callback)
@@ -1184,7 +2094,7 @@ issue:
 			wsi->lws_rx_parse_state = LWS_RXPS_NEW;
 			goto spill;
 		}
-		if (wsi->rx_user_buffer_head != MAX_USER_RX_BUFFER)
+		if (wsi->rx_user_buffer_head != wsi->rx_user_buffer_size)
 			break;
 spill:
 
@@ -1235,6 +2145,15 @@ spill:
 		case LWS_WS_OPCODE_07__CONTINUATION:
 		case LWS_WS_OPCODE_07__TEXT_FRAME:
 		case LWS_WS_OPCODE_07__BINARY_FRAME:
+			if (wsi->protocol->options &
+					  LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE)
+				return lws_rx_message_spill(wsi, 1);
+			if (lws_rx_check_utf8(wsi, (unsigned char *)
+			    &wsi->rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING],
+			      wsi->rx_user_buffer_head,
+			      wsi->lws_rx_parse_state == LWS_RXPS_NEW &&
+								  wsi->final))
+				return -1;
 			break;
 
 		default:
@@ -1269,47 +2188,306 @@ spill:
 				return 0;
 			}
 
-			break;
-		}
+			break;
+		}
+
+		/*
+		 * No it's real payload, pass it up to the user callback.
+		 * It's nicely buffered with the pre-padding taken care of
+		 * so it can be sent straight out again using libwebsocket_write
+		 */
+
+		if (!handled && wsi->protocol->callback)
+			wsi->protocol->callback(wsi->protocol->owning_server,
+						wsi, callback_action,
+						wsi->user_space,
+			  &wsi->rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING],
+						      wsi->rx_user_buffer_head);
+		wsi->rx_user_buffer_head = 0;
+		break;
+	default:
+		fprintf(stderr, "client rx illegal state\n");
+		return 1;
+	}
+
+	return 0;
+
+illegal_ctl_length:
+
+	fprintf(stderr, "Control frame asking for "
+				"extended length is illegal\n");
+	/* kill the connection */
+	return -1;
+
+}
+
+
+
+/*
+ * Decode a complete v7+ frame header sitting at the start of buf in one go
+ * and leave the parser waiting for payload.  Anything unusual -- a header
+ * split across reads, control opcodes, reserved bits, zero length payload --
+ * returns 0 so the caller feeds the bytes through the incremental state
+ * machine instead, which owns all the checks and special handling.
+ */
+
+static size_t
+lws_rx_frame_header(struct libwebsocket *wsi, unsigned char *buf, size_t len)
+{
+	size_t hlen = 2;
+	size_t plen;
+	int n;
+
+	if (len < 2 || (buf[0] & 0x78))
+		return 0;
+
+	plen = buf[1] & 0x7f;
+	if (plen == 126)
+		hlen += 2;
+	if (plen == 127)
+		hlen += 8;
+	if (buf[1] & 0x80)
+		hlen += 4;
+	if (len < hlen)
+		return 0;
+
+	switch (plen) {
+	case 126:
+		plen = (buf[2] << 8) | buf[3];
+		break;
+	case 127:
+		if (buf[2] & 0x80)
+			return 0;
+		plen = 0;
+#if defined __LP64__
+		for (n = 2; n < 10; n++)
+#else
+		for (n = 6; n < 10; n++)
+#endif
+			plen = (plen << 8) | buf[n];
+		break;
+	}
+
+	if (!plen)
+		return 0;
+
+	wsi->opcode = buf[0] & 0xf;
+	wsi->final = !!(buf[0] & 0x80);
+	wsi->this_frame_masked = !!(buf[1] & 0x80);
+	wsi->rx_packet_length = plen;
+	wsi->all_zero_nonce = 1;
+
+	if (wsi->this_frame_masked) {
+		memcpy(wsi->frame_masking_nonce_04, &buf[hlen - 4], 4);
+		if (buf[hlen - 4] | buf[hlen - 3] | buf[hlen - 2] |
+								buf[hlen - 1])
+			wsi->all_zero_nonce = 0;
+		wsi->frame_mask_index = 0;
+	}
+
+	wsi->lws_rx_parse_state = LWS_RXPS_PAYLOAD_UNTIL_LENGTH_EXHAUSTED;
+
+	return hlen;
+}
+
+/*
+ * Move as much payload as possible from buf into rx_user_buffer, unmasking
+ * on the way.  We always stop one byte short of the end of the frame or of
+ * the user buffer, so that byte goes through the state machine and triggers
+ * the usual spill processing.
+ */
+
+static size_t
+lws_rx_payload_span(struct libwebsocket *wsi, unsigned char *buf, size_t len,
+								   int raw)
+{
+	unsigned char *p;
+	size_t n;
+	size_t m;
+
+	if (wsi->rx_packet_length <= 1 || (!wsi->rx_user_buffer &&
+						     lws_rx_buffer_alloc(wsi)) ||
+		      wsi->rx_user_buffer_head >= wsi->rx_user_buffer_size - 1)
+		return 0;
+
+	n = wsi->rx_user_buffer_size - 1 - wsi->rx_user_buffer_head;
+	if (n > wsi->rx_packet_length - 1)
+		n = wsi->rx_packet_length - 1;
+	if (n > len)
+		n = len;
+
+	p = (unsigned char *)&wsi->rx_user_buffer[
+			LWS_SEND_BUFFER_PRE_PADDING + wsi->rx_user_buffer_head];
+
+	if (raw)
+		memcpy(p, buf, n);
+	else
+		if (wsi->xor_mask == xor_mask_05)
+			wsi->frame_mask_index = lws_mask_span(p, buf, n,
+				wsi->frame_masking_nonce_04,
+				wsi->frame_mask_index);
+		else
+			for (m = 0; m < n; m++)
+				p[m] = wsi->xor_mask(wsi, buf[m]);
+
+	wsi->rx_user_buffer_head += n;
+	wsi->rx_packet_length -= n;
+
+	return n;
+}
+
+/*
+ * LWS_PROTOCOL_OPTION_RX_IN_PLACE: unmask the payload where it lies in the
+ * read buffer and hand that slice straight to the user callback
+ */
+
+static int
+lws_rx_payload_in_place(struct libwebsocket *wsi, unsigned char *buf,
+					     size_t len, int raw, int client)
+{
+	size_t n = len;
+
+	if (n > wsi->rx_packet_length)
+		n = wsi->rx_packet_length;
+
+	if (!raw)
+		wsi->frame_mask_index = lws_mask_span(buf, buf, n,
+						 wsi->frame_masking_nonce_04,
+						       wsi->frame_mask_index);
+
+	wsi->rx_packet_length -= n;
+	if (!wsi->rx_packet_length)
+		wsi->lws_rx_parse_state = LWS_RXPS_NEW;
+
+	if (lws_rx_check_utf8(wsi, buf, n, !wsi->rx_packet_length &&
+								   wsi->final))
+		return -1;
+
+	if (wsi->protocol->callback)
+		wsi->protocol->callback(wsi->protocol->owning_server, wsi,
+			client ? LWS_CALLBACK_CLIENT_RECEIVE :
+			LWS_CALLBACK_RECEIVE, wsi->user_space, buf, n);
+
+	return n;
+}
+
+/*
+ * LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE: take the payload straight from the
+ * read buffer into the message being gathered
+ */
+
+static int
+lws_rx_payload_message(struct libwebsocket *wsi, unsigned char *buf,
+					     size_t len, int raw, int client)
+{
+	size_t n = len;
+
+	if (n > wsi->rx_packet_length)
+		n = wsi->rx_packet_length;
+
+	if (lws_rx_message_append(wsi, buf, n, !raw))
+		return -1;
+
+	wsi->rx_packet_length -= n;
+	if (!wsi->rx_packet_length) {
+		wsi->lws_rx_parse_state = LWS_RXPS_NEW;
+		if (wsi->final && lws_rx_message_deliver(wsi, client))
+			return -1;
+	}
+
+	return n;
+}
+
+/*
+ * can the payload of this frame skip rx_user_buffer?  Only for v7+ data
+ * frames, with nothing already buffered for them
+ */
 
-		/*
-		 * No it's real payload, pass it up to the user callback.
-		 * It's nicely buffered with the pre-padding taken care of
-		 * so it can be sent straight out again using libwebsocket_write
-		 */
+static int
+lws_rx_direct(struct libwebsocket *wsi)
+{
+	if (!(wsi->protocol->options & (LWS_PROTOCOL_OPTION_RX_IN_PLACE |
+				    LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE)) ||
+				wsi->ietf_spec_revision < 7 ||
+				!wsi->rx_packet_length ||
+				wsi->rx_user_buffer_head)
+		return 0;
 
-		if (!handled && wsi->protocol->callback)
-			wsi->protocol->callback(wsi->protocol->owning_server,
-						wsi, callback_action,
-						wsi->user_space,
-			  &wsi->rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING],
-						      wsi->rx_user_buffer_head);
-		wsi->rx_user_buffer_head = 0;
-		break;
-	default:
-		fprintf(stderr, "client rx illegal state\n");
+	switch (wsi->opcode) {
+	case LWS_WS_OPCODE_07__CONTINUATION:
+	case LWS_WS_OPCODE_07__TEXT_FRAME:
+	case LWS_WS_OPCODE_07__BINARY_FRAME:
 		return 1;
 	}
 
 	return 0;
+}
 
-illegal_ctl_length:
+static int
+lws_rx_spans(struct libwebsocket *wsi, unsigned char *buf, size_t len,
+								int client)
+{
+	size_t n = 0;
+	int raw;
+	int m;
 
-	fprintf(stderr, "Control frame asking for "
-				"extended length is illegal\n");
-	/* kill the connection */
-	return -1;
+	wsi->rx_user_buffer_idle = 0;
 
-}
+	while (n < len) {
+
+		if (wsi->lws_rx_parse_state == LWS_RXPS_NEW &&
+					       wsi->ietf_spec_revision >= 7) {
+			n += lws_rx_frame_header(wsi, &buf[n], len - n);
+			if (n == len)
+				break;
+		}
+
+		if (wsi->lws_rx_parse_state ==
+				      LWS_RXPS_PAYLOAD_UNTIL_LENGTH_EXHAUSTED) {
+			if (client)
+				raw = !wsi->this_frame_masked ||
+							   wsi->all_zero_nonce;
+			else
+				raw = wsi->ietf_spec_revision < 4 ||
+						      (wsi->all_zero_nonce &&
+						   wsi->ietf_spec_revision >= 5);
+
+			if (lws_rx_direct(wsi)) {
+				if (wsi->protocol->options &
+				       LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE)
+					m = lws_rx_payload_message(wsi,
+					      &buf[n], len - n, raw, client);
+				else
+					m = lws_rx_payload_in_place(wsi,
+					      &buf[n], len - n, raw, client);
+				if (m < 0)
+					return -1;
+				n += m;
+				continue;
+			}
+
+			n += lws_rx_payload_span(wsi, &buf[n], len - n, raw);
+			if (n == len)
+				break;
+		}
 
+		if (client) {
+			if (libwebsocket_client_rx_sm(wsi, buf[n++]) < 0)
+				return -1;
+		} else
+			if (libwebsocket_rx_sm(wsi, buf[n++]) < 0)
+				return -1;
+	}
 
+	return 0;
+}
 
 int libwebsocket_interpret_incoming_packet(struct libwebsocket *wsi,
 						 unsigned char *buf, size_t len)
 {
+#ifdef DEBUG
 	int n;
 
-#ifdef DEBUG
 	fprintf(stderr, "received %d byte packet\n", (int)len);
 	for (n = 0; n < len; n++)
 		fprintf(stderr, "%02X ", buf[n]);
@@ -1318,12 +2496,13 @@ int libwebsocket_interpret_incoming_packet(struct libwebsocket *wsi,
 
 	/* let the rx protocol state machine have as much as it needs */
 
-	n = 0;
-	while (n < len)
-		if (libwebsocket_rx_sm(wsi, buf[n++]) < 0)
-			return -1;
+	return lws_rx_spans(wsi, buf, len, 0);
+}
 
-	return 0;
+int libwebsocket_client_interpret_incoming_packet(struct libwebsocket *wsi,
+						 unsigned char *buf, size_t len)
+{
+	return lws_rx_spans(wsi, buf, len, 1);
 }
 
 
@@ -1401,6 +2580,207 @@ void lws_stderr_hexdump(unsigned char *buf, size_t len)
 	fprintf(stderr, "\n");
 }
 
+/*
+ * lws_send_some() - send what the socket will take right now
+ *
+ * Returns the number of bytes the kernel (or SSL) accepted, which may be
+ * less than len or 0 if it pushed back, or -1 on a fatal error.
+ */
+
+static int
+lws_send_some(struct libwebsocket *wsi, unsigned char *buf, size_t len)
+{
+	int n;
+
+#ifdef LWS_OPENSSL_SUPPORT
+	if (wsi->ssl) {
+		n = SSL_write(wsi->ssl, buf, len);
+		if (n > 0)
+			return n;
+		switch (SSL_get_error(wsi->ssl, n)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+		}
+		fprintf(stderr, "ERROR writing to socket\n");
+		return -1;
+	}
+#endif
+	n = send(wsi->sock, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n >= 0)
+		return n;
+	if (LWS_ERRNO == LWS_EAGAIN || LWS_ERRNO == LWS_EINTR)
+		return 0;
+
+	fprintf(stderr, "ERROR writing to socket\n");
+
+	return -1;
+}
+
+static void
+lws_tx_queue_link(struct libwebsocket *wsi, struct lws_tx_chunk *chunk)
+{
+	size_t len = chunk->len - chunk->offset;
+
+	chunk->next = NULL;
+
+	if (wsi->tx_head) {
+		wsi->tx_tail->next = chunk;
+		wsi->tx_tail = chunk;
+	} else {
+		wsi->tx_head = chunk;
+		wsi->tx_tail = chunk;
+		lws_change_pollfd(wsi->protocol->owning_server, wsi,
+								  0, POLLOUT);
+	}
+	wsi->tx_pending += len;
+	wsi->send_choked = 1;
+
+	debug("queued %d tx bytes, %d pending\n", (int)len,
+						      (int)wsi->tx_pending);
+}
+
+/*
+ * lws_tx_queue_append() - keep bytes the socket could not take yet
+ *
+ * They are copied onto the end of the connection's transmit queue, and
+ * POLLOUT is armed so lws_tx_queue_flush() gets called when there is room.
+ */
+
+int
+lws_tx_queue_append(struct libwebsocket *wsi, unsigned char *buf, size_t len)
+{
+	struct lws_tx_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk) + len);
+	if (chunk == NULL) {
+		fprintf(stderr, "Out of memory queueing tx\n");
+		return -1;
+	}
+	chunk->frame = NULL;
+	chunk->data = (unsigned char *)(chunk + 1);
+	chunk->len = len;
+	chunk->offset = 0;
+	memcpy(chunk->data, buf, len);
+
+	lws_tx_queue_link(wsi, chunk);
+
+	return 0;
+}
+
+/*
+ * lws_tx_frame_unref() - drop one reference to a shared frame
+ *
+ * The frame is freed when the last queue holding it has sent it.
+ */
+
+void
+lws_tx_frame_unref(struct lws_tx_frame *frame)
+{
+	if (--frame->refcount)
+		return;
+
+	free(frame);
+}
+
+/*
+ * lws_tx_send_frame() - send a shared frame on one connection
+ *
+ * Sends what it can right away; if anything is left, the queue takes a
+ * reference on the frame instead of copying it.
+ */
+
+int
+lws_tx_send_frame(struct libwebsocket *wsi, struct lws_tx_frame *frame)
+{
+	struct lws_tx_chunk *chunk;
+	int n = 0;
+
+	if (!wsi->tx_head) {
+		n = lws_send_some(wsi, (unsigned char *)(frame + 1),
+								   frame->len);
+		if (n < 0)
+			return -1;
+		if ((size_t)n == frame->len)
+			return 0;
+	}
+
+	chunk = malloc(sizeof(*chunk));
+	if (chunk == NULL) {
+		fprintf(stderr, "Out of memory queueing tx\n");
+		return -1;
+	}
+	frame->refcount++;
+	chunk->frame = frame;
+	chunk->data = (unsigned char *)(frame + 1);
+	chunk->len = frame->len;
+	chunk->offset = n;
+
+	lws_tx_queue_link(wsi, chunk);
+
+	return 0;
+}
+
+/*
+ * lws_tx_queue_flush() - send as much of the transmit queue as will go
+ *
+ * Called when the socket reports POLLOUT.  Returns -1 on a fatal error,
+ * otherwise 0; wsi->tx_head is NULL afterwards if everything went out.
+ */
+
+int
+lws_tx_queue_flush(struct libwebsocket *wsi)
+{
+	struct lws_tx_chunk *chunk;
+	int n;
+
+	while (wsi->tx_head) {
+		chunk = wsi->tx_head;
+
+		n = lws_send_some(wsi, chunk->data + chunk->offset,
+					      chunk->len - chunk->offset);
+		if (n < 0)
+			return -1;
+		if (!n)
+			return 0;
+
+		chunk->offset += n;
+		wsi->tx_pending -= n;
+		if (chunk->offset != chunk->len)
+			return 0;
+
+		wsi->tx_head = chunk->next;
+		if (chunk->frame)
+			lws_tx_frame_unref(chunk->frame);
+		free(chunk);
+	}
+
+	wsi->tx_tail = NULL;
+	wsi->send_choked = 0;
+
+	return 0;
+}
+
+/*
+ * lws_tx_queue_free() - drop anything still queued on a dying connection
+ */
+
+void
+lws_tx_queue_free(struct libwebsocket *wsi)
+{
+	struct lws_tx_chunk *chunk;
+
+	while (wsi->tx_head) {
+		chunk = wsi->tx_head;
+		wsi->tx_head = chunk->next;
+		if (chunk->frame)
+			lws_tx_frame_unref(chunk->frame);
+		free(chunk);
+	}
+	wsi->tx_tail = NULL;
+	wsi->tx_pending = 0;
+}
+
 int lws_issue_raw(struct libwebsocket *wsi, unsigned char *buf, size_t len)
 {
 	int n;
@@ -1442,25 +2822,25 @@ int lws_issue_raw(struct libwebsocket *wsi, unsigned char *buf, size_t len)
 	lws_stderr_hexdump(buf, len);
 #endif
 
-#ifdef LWS_OPENSSL_SUPPORT
-	if (wsi->ssl) {
-		n = SSL_write(wsi->ssl, buf, len);
-		if (n < 0) {
-			fprintf(stderr,
-				   "ERROR writing to socket\n");
-			return -1;
-		}
-	} else {
-#endif
-		n = send(wsi->sock, buf, len, MSG_NOSIGNAL);
-		if (n < 0) {
-			fprintf(stderr,
-				   "ERROR writing to socket\n");
-			return -1;
-		}
-#ifdef LWS_OPENSSL_SUPPORT
-	}
-#endif
+	/*
+	 * if there's already data waiting, this has to go out after it
+	 */
+
+	if (wsi->tx_head)
+		return lws_tx_queue_append(wsi, buf, len);
+
+	n = lws_send_some(wsi, buf, len);
+	if (n < 0)
+		return -1;
+
+	/*
+	 * the kernel didn't take all of it right now: keep the rest and
+	 * send it when the socket becomes writeable
+	 */
+
+	if ((size_t)n < len)
+		return lws_tx_queue_append(wsi, buf + n, len - n);
+
 	return 0;
 }
 
@@ -1796,20 +3176,30 @@ int libwebsocket_write(struct libwebsocket *wsi, unsigned char *buf,
 			}
 
 
-			if (wsi->ietf_spec_revision < 7)
+			if (wsi->ietf_spec_revision < 7) {
 				/*
 				 * use the XOR masking against everything we
 				 * send past the frame key
 				 */
-				for (n = -pre; n < ((int)len + post); n++)
-					buf[n] = wsi->xor_mask(wsi, buf[n]);
-			else
+				if (wsi->xor_mask == xor_mask_05)
+					wsi->frame_mask_index = lws_mask_span(
+						&buf[-pre], &buf[-pre],
+						pre + len + post,
+						wsi->frame_masking_nonce_04,
+						wsi->frame_mask_index);
+				else
+					for (n = -pre; n < ((int)len + post);
+									   n++)
+						buf[n] = wsi->xor_mask(wsi,
+									buf[n]);
+			} else
 				/*
 				 * in v7, just mask the payload
 				 */
-				for (n = 0; n < (int)len; n++)
-					dropmask[n + 4] =
-					   wsi->xor_mask(wsi, dropmask[n + 4]);
+				wsi->frame_mask_index = lws_mask_span(
+					&dropmask[4], &dropmask[4], len,
+					wsi->frame_masking_nonce_04,
+					wsi->frame_mask_index);
 
 
 			if (wsi->ietf_spec_revision < 7) {
@@ -1881,6 +3271,201 @@ send_raw:
 	return lws_issue_raw_ext_access(wsi, buf - pre, len + pre + post);
 }
 
+/*
+ * lws_frame_header() - build the frame header for a data frame
+ *
+ * Only for the unmasked 04+ framing that is sent without going through
+ * libwebsocket_write(); returns the header length or -1 if the opcode
+ * isn't one it handles.
+ */
+
+int
+lws_frame_header(unsigned char *hdr, int ietf_spec_revision, size_t len,
+				       enum libwebsocket_write_protocol protocol)
+{
+	int n;
+	int v7 = ietf_spec_revision >= 7;
+
+	switch (protocol & 0xf) {
+	case LWS_WRITE_TEXT:
+		n = v7 ? LWS_WS_OPCODE_07__TEXT_FRAME :
+						   LWS_WS_OPCODE_04__TEXT_FRAME;
+		break;
+	case LWS_WRITE_BINARY:
+		n = v7 ? LWS_WS_OPCODE_07__BINARY_FRAME :
+						 LWS_WS_OPCODE_04__BINARY_FRAME;
+		break;
+	case LWS_WRITE_CONTINUATION:
+		n = v7 ? LWS_WS_OPCODE_07__CONTINUATION :
+						 LWS_WS_OPCODE_04__CONTINUATION;
+		break;
+	default:
+		return -1;
+	}
+
+	if (!(protocol & LWS_WRITE_NO_FIN))
+		n |= 1 << 7;
+
+	hdr[0] = n;
+
+	if (len < 126) {
+		hdr[1] = len;
+		return 2;
+	}
+
+	if (len < 65536) {
+		hdr[1] = 126;
+		hdr[2] = len >> 8;
+		hdr[3] = len;
+		return 4;
+	}
+
+	hdr[1] = 127;
+#if defined __LP64__
+	hdr[2] = (len >> 56) & 0x7f;
+	hdr[3] = len >> 48;
+	hdr[4] = len >> 40;
+	hdr[5] = len >> 32;
+#else
+	hdr[2] = 0;
+	hdr[3] = 0;
+	hdr[4] = 0;
+	hdr[5] = 0;
+#endif
+	hdr[6] = len >> 24;
+	hdr[7] = len >> 16;
+	hdr[8] = len >> 8;
+	hdr[9] = len;
+
+	return 10;
+}
+
+/**
+ * libwebsocket_write_iov() - Send one frame made of several buffers
+ * @wsi:	Websocket instance (available from user callback)
+ * @iov:	The pieces of the payload, in order
+ * @iovcnt:	Count of entries in @iov
+ * @protocol:	As for libwebsocket_write()
+ *
+ *	This sends the concatenation of the @iov buffers as a single frame
+ *	(or raw http data for LWS_WRITE_HTTP).  Unlike libwebsocket_write(),
+ *	the buffers need no LWS_SEND_BUFFER_PRE_PADDING or
+ *	LWS_SEND_BUFFER_POST_PADDING around them and are not modified, so
+ *	a shared body can be sent to many connections without copying it.
+ *
+ *	On a plain server connection with no active extensions, text,
+ *	binary, continuation and http data go out with one sendmsg() that
+ *	has the frame header in front of your buffers.  Otherwise, eg, with
+ *	SSL, masking or an extension like deflate that needs to see the
+ *	whole payload, the pieces are copied into one buffer and sent with
+ *	libwebsocket_write().
+ */
+
+int
+libwebsocket_write_iov(struct libwebsocket *wsi, const struct iovec *iov,
+		    int iovcnt, enum libwebsocket_write_protocol protocol)
+{
+	unsigned char *buf;
+	size_t len = 0;
+	int n;
+#ifndef WIN32
+	unsigned char hdr[10];
+	struct iovec vec[LWS_WRITE_IOV_MAX + 1];
+	struct msghdr msg;
+	size_t sent;
+	int m;
+#endif
+
+	for (n = 0; n < iovcnt; n++)
+		len += iov[n].iov_len;
+
+#ifndef WIN32
+	if (iovcnt > LWS_WRITE_IOV_MAX || wsi->count_active_extensions)
+		goto gather;
+#ifdef LWS_OPENSSL_SUPPORT
+	if (wsi->ssl)
+		goto gather;
+#endif
+
+	m = 0;
+	if (protocol != LWS_WRITE_HTTP) {
+		if (wsi->state != WSI_STATE_ESTABLISHED)
+			return -1;
+		if (wsi->mode != LWS_CONNMODE_WS_SERVING ||
+					       wsi->ietf_spec_revision < 4)
+			goto gather;
+		m = lws_frame_header(hdr, wsi->ietf_spec_revision, len,
+								      protocol);
+		if (m < 0)
+			goto gather;
+	}
+
+	vec[0].iov_base = hdr;
+	vec[0].iov_len = m;
+	for (n = 0; n < iovcnt; n++)
+		vec[n + 1] = iov[n];
+
+	/* anything already waiting has to go out first */
+
+	if (wsi->tx_head) {
+		sent = 0;
+		goto queue;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = vec;
+	msg.msg_iovlen = iovcnt + 1;
+
+	n = sendmsg(wsi->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n < 0) {
+		if (LWS_ERRNO != LWS_EAGAIN && LWS_ERRNO != LWS_EINTR) {
+			fprintf(stderr, "ERROR writing to socket\n");
+			return -1;
+		}
+		n = 0;
+	}
+	sent = n;
+
+queue:
+	/* whatever the kernel didn't take goes on the tx queue */
+
+	for (n = 0; n <= iovcnt; n++) {
+		if (sent >= vec[n].iov_len) {
+			sent -= vec[n].iov_len;
+			continue;
+		}
+		if (lws_tx_queue_append(wsi,
+			(unsigned char *)vec[n].iov_base + sent,
+						    vec[n].iov_len - sent))
+			return -1;
+		sent = 0;
+	}
+
+	return 0;
+
+gather:
+#endif
+	buf = malloc(LWS_SEND_BUFFER_PRE_PADDING + len +
+						 LWS_SEND_BUFFER_POST_PADDING);
+	if (buf == NULL) {
+		fprintf(stderr, "Out of memory in libwebsocket_write_iov\n");
+		return -1;
+	}
+
+	len = 0;
+	for (n = 0; n < iovcnt; n++) {
+		memcpy(buf + LWS_SEND_BUFFER_PRE_PADDING + len,
+					       iov[n].iov_base, iov[n].iov_len);
+		len += iov[n].iov_len;
+	}
+
+	n = libwebsocket_write(wsi, buf + LWS_SEND_BUFFER_PRE_PADDING, len,
+								      protocol);
+	free(buf);
+
+	return n;
+}
+
 
 /**
  * libwebsockets_serve_http_file() - Send a file back to the client using http
@@ -1957,7 +3542,9 @@ int libwebsockets_serve_http_file(struct libwebsocket *wsi, const char *file,
  *  when that is the case libwebsockets_remaining_packet_payload() will return
  *  0.
  *
- *  Many protocols won't care becuse their packets are always small.
+ *  Many protocols won't care becuse their packets are always small.  Those
+ *  that do can set LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE and have each
+ *  message delivered in one piece instead.
  */
 
 size_t
@@ -19,6 +19,10 @@
  *  MA  02110-1301  USA
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for accept4() */
+#endif
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +32,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <limits.h>
 #ifdef  __MINGW64__
 #else
 #ifdef  __MINGW32__
@@ -68,6 +73,26 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#define LWS_HAS_EPOLL
+#include <sys/syscall.h>
+#ifdef SYS_getrandom
+#define LWS_HAS_GETRANDOM
+#endif
+#endif
+
+#ifdef SO_REUSEPORT
+#include <pthread.h>
+#define LWS_HAS_SERVICE_THREADS
+#endif
+
+#define LWS_HAS_TASK_QUEUE
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define LWS_HAS_EVENTFD
+#endif
+
 #endif
 
 #ifdef LWS_OPENSSL_SUPPORT
@@ -116,21 +141,70 @@ void debug(const char *format, ...)
 #define MSG_NOSIGNAL SO_NOSIGPIPE
 #endif
 
+/*
+ * platforms without MSG_DONTWAIT just do a normal send and never report
+ * the pipe as choked
+ */
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
+
+#define LWS_INITIAL_FDS_ALLOC 64
 
-#define FD_HASHTABLE_MODULUS 32
-#define MAX_CLIENTS 100
+/* more pieces than this go through libwebsocket_write() after a copy */
+#define LWS_WRITE_IOV_MAX 16
+#define LWS_INITIAL_LOOKUP_ALLOC 64
+
+/* timeout wheel: 64 one-second slots per level, 64^3s (~3 days) span */
+#define LWS_TIMER_WHEEL_BITS 6
+#define LWS_TIMER_WHEEL_SLOTS (1 << LWS_TIMER_WHEEL_BITS)
+#define LWS_TIMER_WHEEL_MASK (LWS_TIMER_WHEEL_SLOTS - 1)
+#define LWS_TIMER_WHEEL_LEVELS 3
+
+/* most connections taken off the listen backlog per wakeup */
+#define LWS_DEFAULT_ACCEPT_BATCH 32
+
+/* longest a service thread waits before checking if it should stop */
+#define LWS_SERVICE_THREAD_WAIT_MS 100
 #define LWS_MAX_HEADER_NAME_LENGTH 64
 #define LWS_MAX_HEADER_LEN 4096
+/* all header values of one connection share a buffer growing up to this */
 #define LWS_INITIAL_HDR_ALLOC 256
-#define LWS_ADDITIONAL_HDR_ALLOC 64
+#define LWS_MAX_HEADERS_LEN (4 * LWS_MAX_HEADER_LEN)
+/* header names hash into this many slots, must be 2^n */
+#define LWS_HDR_HASH_SIZE 64
+#define LWS_MAX_USER_HEADERS 16
 #define MAX_USER_RX_BUFFER 4096
+#define MIN_USER_RX_BUFFER 128
+/* seconds with nothing received before an empty rx buffer is given back */
+#define LWS_RX_BUFFER_IDLE_SECS 5
+/* whole message rx: default size limit, and largest buffer kept for reuse */
+#define LWS_DEFAULT_MAX_MESSAGE (1024 * 1024)
+#define LWS_RX_MESSAGE_INITIAL 4096
+#define LWS_RX_MESSAGE_KEEP (64 * 1024)
 #define MAX_BROADCAST_PAYLOAD 2048
+
+/*
+ * established connections read until the socket is drained or they used up
+ * the budget for one wakeup; the read size follows what each one receives
+ */
+#define LWS_READ_SIZE_MIN 4096
+#define LWS_READ_SIZE_MAX (256 * 1024)
+#define LWS_READ_BUDGET (1024 * 1024)
+
+/* bytes of shared ring carrying broadcasts to a forked service loop, 2^n */
+#define LWS_BROADCAST_RING_SIZE (256 * 1024)
 #define LWS_MAX_PROTOCOLS 10
 #define LWS_MAX_EXTENSIONS_ACTIVE 10
 #define SPEC_LATEST_SUPPORTED 13
 
+#define LWS_EPOLL_MAX_EVENTS 256
+
 #define MAX_WEBSOCKET_04_KEY_LEN 128
 #define SYSTEM_RANDOM_FILEPATH "/dev/urandom"
+/* random bytes fetched per refill, masks and keys are served from these */
+#define LWS_RANDOM_POOL_SIZE 1024
 
 enum lws_websocket_opcodes_04 {
 	LWS_WS_OPCODE_04__CONTINUATION = 0,
@@ -220,35 +294,140 @@ enum connection_mode {
 	LWS_CONNMODE_WS_CLIENT_WAITING_SERVER_REPLY,
 	LWS_CONNMODE_WS_CLIENT_WAITING_EXTENSION_CONNECT,
 	LWS_CONNMODE_WS_CLIENT_PENDING_CANDIDATE_CHILD,
+#ifdef LWS_OPENSSL_SUPPORT
+	LWS_CONNMODE_SSL_ACK_PENDING,
+#endif
 
 	/* special internal types */
 	LWS_CONNMODE_SERVER_LISTENER,
-	LWS_CONNMODE_BROADCAST_PROXY_LISTENER,
-	LWS_CONNMODE_BROADCAST_PROXY
+#ifndef LWS_NO_FORK
+	LWS_CONNMODE_BROADCAST_RING,
+#endif
+#ifdef LWS_HAS_TASK_QUEUE
+	LWS_CONNMODE_TASK_WAKEUP,
+#endif
 };
 
 
-#define LWS_FD_HASH(fd) ((fd ^ (fd >> 8) ^ (fd >> 16)) % FD_HASHTABLE_MODULUS)
+#ifdef WIN32
+#define LWS_ERRNO WSAGetLastError()
+#define LWS_EAGAIN WSAEWOULDBLOCK
+#define LWS_EINTR WSAEINTR
+#else
+#define LWS_ERRNO errno
+#define LWS_EAGAIN EAGAIN
+#define LWS_EINTR EINTR
+#endif
 
-struct libwebsocket_fd_hashtable {
-	struct libwebsocket *wsi[MAX_CLIENTS + 1];
-	int length;
+struct libwebsocket_protocols;
+
+enum lws_task_type {
+	LWS_TASK_WRITE,
+	LWS_TASK_CALLBACK_ON_WRITABLE,
+	LWS_TASK_CLOSURE,
 };
 
-struct libwebsocket_protocols;
+/* work posted to the service loop from other threads */
+
+struct lws_task {
+	struct lws_task *next;
+	enum lws_task_type type;
+	unsigned long long connection_id; /* looked up when the task runs */
+	unsigned char *buf; /* LWS_TASK_WRITE, includes padding */
+	size_t len;
+	enum libwebsocket_write_protocol protocol;
+	libwebsocket_task_function *closure; /* LWS_TASK_CLOSURE */
+	void *arg;
+};
+
+/* a framed message shared by several connections' tx queues */
+
+struct lws_tx_frame {
+	int refcount;
+	size_t len;
+	/* frame header and payload follow */
+};
+
+/* bytes the socket would not take yet */
+
+struct lws_tx_chunk {
+	struct lws_tx_chunk *next;
+	struct lws_tx_frame *frame; /* shared data, or NULL if it follows us */
+	unsigned char *data;
+	size_t len;
+	size_t offset; /* how much of it has been sent */
+};
+
+#ifndef LWS_NO_FORK
+
+/*
+ * shared between the process calling libwebsockets_broadcast() and the one
+ * libwebsockets_fork_service_loop() left servicing connections.  head and
+ * tail run freely and are masked into data[], each message is a record
+ * header followed by its payload, padded to 8 bytes.
+ */
+
+#define LWS_BROADCAST_RING_WRAP 0xffffffff /* rest of data[] unused */
+
+struct lws_broadcast_record {
+	unsigned int len;
+	int protocol_index;
+};
+
+struct lws_broadcast_ring {
+	int lock; /* between broadcasting threads / processes */
+	volatile unsigned long head; /* moved only by broadcasters */
+	volatile unsigned long tail; /* moved only by the service loop */
+	unsigned char data[LWS_BROADCAST_RING_SIZE];
+};
+
+#endif
+
+struct lws_timer_wheel {
+	unsigned long now; /* last second the wheel was advanced to */
+	unsigned long long occupied[LWS_TIMER_WHEEL_LEVELS];
+	struct libwebsocket *slot[LWS_TIMER_WHEEL_LEVELS][LWS_TIMER_WHEEL_SLOTS];
+};
 
 struct libwebsocket_context {
-	struct libwebsocket_fd_hashtable fd_hashtable[FD_HASHTABLE_MODULUS];
-	struct pollfd fds[MAX_CLIENTS * FD_HASHTABLE_MODULUS + 1];
+	struct libwebsocket **lws_lookup; /* fd to wsi, indexed by fd */
+	int lws_lookup_len;
+	struct pollfd *fds;
 	int fds_count;
+	int fds_alloc;
+	int max_connections;
+	int accept_batch;
 	int listen_port;
 	char http_proxy_address[256];
 	char canonical_hostname[1024];
 	unsigned int http_proxy_port;
 	unsigned int options;
 	unsigned long last_timeout_check_s;
+	struct lws_timer_wheel timer_wheel;
+	/* connections with active extensions, they get LWS_EXT_CALLBACK_1HZ */
+	struct libwebsocket *ext_1hz_list;
+	/* connections holding an rx buffer, checked for idleness at 1Hz */
+	struct libwebsocket *rx_buffer_list;
 
+	/* -1 when getrandom() is the source */
 	int fd_random;
+	unsigned char random_pool[LWS_RANDOM_POOL_SIZE];
+	int random_pool_pos;
+
+	/* shared by every connection this context services */
+	unsigned char *rx_buf;
+	int rx_buf_size;
+
+	/* libwebsocket_register_header(), hashed like lws_tokens[] */
+	struct lws_tokens user_headers[LWS_MAX_USER_HEADERS];
+	int count_user_headers;
+	unsigned char user_header_hash[LWS_HDR_HASH_SIZE];
+
+#ifdef LWS_HAS_EPOLL
+	/* -1 unless LWS_SERVER_OPTION_USE_EPOLL was given */
+	int epoll_fd;
+	struct epoll_event epoll_events[LWS_EPOLL_MAX_EVENTS];
+#endif
 
 #ifdef LWS_OPENSSL_SUPPORT
 	int use_ssl;
@@ -257,7 +436,30 @@ struct libwebsocket_context {
 #endif
 	struct libwebsocket_protocols *protocols;
 	int count_protocols;
+	int protocols_owned; /* our own copy, made for a service thread */
+	int extensions_constructed; /* we ran their CONTEXT_CONSTRUCT */
 	struct libwebsocket_extension *extensions;
+
+	/*
+	 * a context created with tuning.service_threads > 1 lists itself
+	 * and its siblings here, they all listen on the same port
+	 */
+	struct libwebsocket_context **service_group;
+	int service_group_count;
+	unsigned int connection_serial;
+#ifdef LWS_HAS_TASK_QUEUE
+	struct lws_task *task_queue;
+	int task_wakeup_fd[2]; /* the same eventfd twice, or a pipe */
+#endif
+#ifndef LWS_NO_FORK
+	struct lws_broadcast_ring *broadcast_ring;
+	int broadcast_ring_fd[2]; /* doorbell, as for task_wakeup_fd */
+#endif
+#ifdef LWS_HAS_SERVICE_THREADS
+	pthread_t service_thread;
+	int service_thread_running;
+	int service_thread_stop;
+#endif
 };
 
 
@@ -269,6 +471,7 @@ enum pending_timeout {
 	PENDING_TIMEOUT_AWAITING_PING,
 	PENDING_TIMEOUT_CLOSE_ACK,
 	PENDING_TIMEOUT_AWAITING_EXTENSION_CONNECT_RESPONSE,
+	PENDING_TIMEOUT_SSL_ACCEPT,
 };
 
 
@@ -289,22 +492,51 @@ struct libwebsocket {
 
 	char name_buffer[LWS_MAX_HEADER_NAME_LENGTH];
 	int name_buffer_pos;
-	int current_alloc_len;
 	enum lws_token_indexes parser_state;
 	struct lws_tokens utf8_token[WSI_TOKEN_COUNT];
+	char *hdr_buf; /* utf8_token[] point in here, NUL terminated */
+	int hdr_buf_len;
+	int hdr_buf_alloc;
+	struct lws_tokens *user_token; /* LWS_MAX_USER_HEADERS when used */
+	int user_token_current;
 	int ietf_spec_revision;
-	char rx_user_buffer[LWS_SEND_BUFFER_PRE_PADDING + MAX_USER_RX_BUFFER +
-						  LWS_SEND_BUFFER_POST_PADDING];
+	char *rx_user_buffer;
+	int rx_user_buffer_size;
 	int rx_user_buffer_head;
+	int rx_user_buffer_idle; /* seconds since anything was received */
+	struct libwebsocket *rx_buffer_next;
+	struct libwebsocket **rx_buffer_prev;
+	unsigned char *rx_msg; /* LWS_PROTOCOL_OPTION_RX_WHOLE_MESSAGE */
+	size_t rx_msg_len;
+	size_t rx_msg_alloc;
+	char rx_text; /* the message being received is a text one */
+	unsigned char utf8_state; /* LWS_PROTOCOL_OPTION_RX_VALIDATE_UTF8 */
 	enum libwebsocket_write_protocol rx_frame_type;
-	int protocol_index_for_broadcast_proxy;
 	enum pending_timeout pending_timeout;
 	unsigned long pending_timeout_limit;
+	struct libwebsocket *timeout_next;
+	struct libwebsocket **timeout_prev; /* NULL when not on the wheel */
+	unsigned char timeout_level;
+	unsigned char timeout_slot;
+	struct libwebsocket *ext_1hz_next;
+	struct libwebsocket **ext_1hz_prev;
 
 	int sock;
+	/* fd in the low 32 bits, context's connection serial above */
+	unsigned long long connection_id;
+	int position_in_fds_table; /* -1 while not in context->fds */
+	struct libwebsocket *protocol_next; /* protocol's established list */
+	struct libwebsocket **protocol_prev; /* NULL when not on it */
 
 	enum lws_rx_parse_state lws_rx_parse_state;
 	char extension_data_pending;
+	char send_choked; /* last send could not all go out immediately */
+	char writeable_requested; /* user is waiting for a WRITEABLE cb */
+	char rx_paused; /* libwebsocket_rx_flow_control() turned off rx */
+	int read_size; /* next socket read size, adapts to the traffic */
+	struct lws_tx_chunk *tx_head; /* unsent output, oldest first */
+	struct lws_tx_chunk *tx_tail;
+	size_t tx_pending; /* total bytes waiting in the tx queue */
 	struct libwebsocket *candidate_children_list;
 	struct libwebsocket *extension_handles;
 
@@ -354,12 +586,21 @@ extern int
 libwebsocket_client_rx_sm(struct libwebsocket *wsi, unsigned char c);
 
 extern int
-libwebsocket_parse(struct libwebsocket *wsi, unsigned char c);
+libwebsocket_parse(struct libwebsocket_context *context,
+				 struct libwebsocket *wsi, unsigned char c);
+
+extern int
+lws_parse_span(struct libwebsocket_context *context, struct libwebsocket *wsi,
+				       const unsigned char *buf, size_t len);
 
 extern int
 libwebsocket_interpret_incoming_packet(struct libwebsocket *wsi,
 						unsigned char *buf, size_t len);
 
+extern int
+libwebsocket_client_interpret_incoming_packet(struct libwebsocket *wsi,
+						unsigned char *buf, size_t len);
+
 extern int
 libwebsocket_read(struct libwebsocket_context *context,
 				struct libwebsocket *wsi,
@@ -377,6 +618,30 @@ xor_mask_04(struct libwebsocket *wsi, unsigned char c);
 extern unsigned char
 xor_mask_05(struct libwebsocket *wsi, unsigned char c);
 
+extern unsigned char (*lws_mask_span)(unsigned char *dst,
+		const unsigned char *src, size_t len, const unsigned char *key,
+							  unsigned char idx);
+
+extern size_t (*lws_ascii_span)(const unsigned char *p, size_t len);
+
+extern void
+lws_select_kernels(void);
+
+extern unsigned char
+lws_utf8_validate(unsigned char state, const unsigned char *p, size_t len);
+
+extern int
+lws_rx_buffer_alloc(struct libwebsocket *wsi);
+
+extern void
+lws_rx_buffer_free(struct libwebsocket *wsi);
+
+extern void
+lws_rx_buffers_idle(struct libwebsocket_context *context);
+
+extern void
+lws_rx_message_free(struct libwebsocket *wsi);
+
 extern struct libwebsocket *
 wsi_from_fd(struct libwebsocket_context *context, int fd);
 
@@ -386,17 +651,61 @@ insert_wsi(struct libwebsocket_context *context, struct libwebsocket *wsi);
 extern int
 delete_from_fd(struct libwebsocket_context *context, int fd);
 
+extern int
+insert_wsi_socket_into_fds(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi);
+
+extern void
+lws_protocol_join(struct libwebsocket *wsi);
+
 extern void
-libwebsocket_set_timeout(struct libwebsocket *wsi,
-					 enum pending_timeout reason, int secs);
+lws_protocol_leave(struct libwebsocket *wsi);
+
+extern void
+remove_wsi_socket_from_fds(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi);
+
+extern int
+lws_set_nonblocking(int fd, int nonblocking);
+
+extern int
+lws_change_pollfd(struct libwebsocket_context *context,
+			     struct libwebsocket *wsi, int clear, int set);
+
+extern void
+libwebsocket_set_timeout(struct libwebsocket_context *context,
+		struct libwebsocket *wsi, enum pending_timeout reason, int secs);
 
 extern int
 lws_issue_raw(struct libwebsocket *wsi, unsigned char *buf, size_t len);
 
+extern int
+lws_tx_queue_append(struct libwebsocket *wsi, unsigned char *buf, size_t len);
+
+extern int
+lws_tx_queue_flush(struct libwebsocket *wsi);
+
+extern void
+lws_tx_queue_free(struct libwebsocket *wsi);
+
+extern void
+lws_tx_frame_unref(struct lws_tx_frame *frame);
+
+extern int
+lws_tx_send_frame(struct libwebsocket *wsi, struct lws_tx_frame *frame);
+
+extern int
+lws_frame_header(unsigned char *hdr, int ietf_spec_revision, size_t len,
+				      enum libwebsocket_write_protocol protocol);
+
+
+extern void
+lws_timeouts_unlink(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi);
 
 extern void
-libwebsocket_service_timeout_check(struct libwebsocket_context *context,
-				    struct libwebsocket *wsi, unsigned int sec);
+lws_ext_1hz_add(struct libwebsocket_context *context,
+						      struct libwebsocket *wsi);
 
 extern struct libwebsocket *
 __libwebsocket_client_connect_2(struct libwebsocket_context *context,
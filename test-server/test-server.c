@@ -384,6 +384,7 @@ static struct option options[] = {
 	{ "killmask",	no_argument,		NULL, 'k' },
 	{ "interface",  required_argument,	NULL, 'i' },
 	{ "closetest",  no_argument,		NULL, 'c' },
+	{ "epoll",	no_argument,		NULL, 'e' },
 	{ NULL, 0, 0, 0 }
 };
 
@@ -411,7 +412,7 @@ int main(int argc, char **argv)
 						    "licensed under LGPL2.1\n");
 
 	while (n >= 0) {
-		n = getopt_long(argc, argv, "ci:khsp:", options, NULL);
+		n = getopt_long(argc, argv, "eci:khsp:", options, NULL);
 		if (n < 0)
 			continue;
 		switch (n) {
@@ -419,7 +420,10 @@ int main(int argc, char **argv)
 			use_ssl = 1;
 			break;
 		case 'k':
-			opts = LWS_SERVER_OPTION_DEFEAT_CLIENT_MASK;
+			opts |= LWS_SERVER_OPTION_DEFEAT_CLIENT_MASK;
+			break;
+		case 'e':
+			opts |= LWS_SERVER_OPTION_USE_EPOLL;
 			break;
 		case 'p':
 			port = atoi(optarg);
@@ -437,7 +441,7 @@ int main(int argc, char **argv)
 			break;
 		case 'h':
 			fprintf(stderr, "Usage: test-server "
-					     "[--port=<p>] [--ssl]\n");
+					     "[--port=<p>] [--ssl] [--epoll]\n");
 			exit(1);
 		}
 	}
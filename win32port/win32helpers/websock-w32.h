@@ -16,6 +16,13 @@
 
 #define SOL_TCP IPPROTO_TCP
 
+/* for libwebsocket_write_iov(), which just gathers the pieces on windows */
+
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
 #define random rand
 #define usleep _sleep
 